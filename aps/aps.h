@@ -0,0 +1,104 @@
+//
+// File:        aps.h
+//
+// Abstract:    Library of searching string in buffers in memory. Pattern is compiled once into handle,
+//              which can be shared by all threads, and every thread searches its buffers with its own scratch.
+//              Library is main.c compiled with APS_LIBRARY, command line aps uses the same functions.
+//              Scope of library is only compile and search of buffer in memory. Files, I/O strategies,
+//              streams, native workers, index, OpenCL and printing of results stay in drivers of command line,
+//              which search patterns compiled by apsPatternCompile. Library never prints out anything.
+// Version:     <2.1>
+//
+// Copyright ( C ) 2017 Simon Harvan. All Rights Reserved.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef APS_H
+#define APS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define APS_API __attribute__((visibility("default")))
+#else
+#define APS_API
+#endif
+
+#define APS_IGNORE_CASE 1
+#define APS_WILDCARDS 2
+#define APS_EDITS 4
+
+/**
+ Size of buffer for reason, why patterns cannot be compiled, including terminating zero.
+ */
+#define APS_ERROR_SIZE 128
+
+/**
+ Compiled patterns with tables of matcher (prefix from compute_prefix_function, shifts, SIMD prefilter, automaton). It is read only after apsPatternCompile, so one handle can be searched by more threads at once.
+ */
+typedef struct apsPattern apsPattern;
+
+/**
+ Everything one search changes: buffer of results and end of last occurance of every pattern. Scratch belongs to one thread and it is reused by all its searches, so search itself allocates nothing.
+ */
+typedef struct apsScratch apsScratch;
+
+/**
+ Function called for every occurance in order of offsets (for more patterns in order of their ends). Occurances overlapping previous occurance of the same pattern are skipped like by aps.
+ context            - context given to apsSearch
+ offset             - offset of occurance from beginning of buffer, from 0
+ pattern            - index of pattern in patterns given to apsPatternCompile
+ Returns 0 to continue, anything else stops search.
+ */
+typedef int (*apsCallback)(void *context, unsigned long offset, unsigned long pattern);
+
+/**
+ Function compiles patterns. Patterns are copied, so they do not have to live longer than call. Returns NULL on error, library prints out nothing, reason is written into error.
+ patterns           - needles, zero terminated
+ numberOfPatterns   - length of patterns
+ algorithm          - kmp, bmh, twoway, ahocorasick, shiftor or NULL (or auto) to select matcher by pattern
+ options            - APS_IGNORE_CASE folds ASCII letters, APS_WILDCARDS makes ? match any byte, APS_EDITS makes errors also inserted and deleted bytes
+ errors             - allowed mismatched bytes (or edits with APS_EDITS), 0 for exact matching
+ error              - buffer of APS_ERROR_SIZE bytes for reason of failure, like "Unknown algorithm x!", or NULL
+ */
+APS_API apsPattern *apsPatternCompile(const char **patterns, unsigned long numberOfPatterns, const char *algorithm, int options, unsigned long errors, char *error);
+
+/**
+ Function releases compiled patterns. No scratch of them can be used after it.
+ */
+APS_API void apsPatternFree(apsPattern *pattern);
+
+/**
+ Function returns name of matcher, which was chosen for patterns.
+ */
+APS_API const char *apsPatternAlgorithm(const apsPattern *pattern);
+
+/**
+ Function prepares scratch for searches of compiled patterns in one thread. Returns NULL, when there is not enough memory.
+ */
+APS_API apsScratch *apsScratchNew(const apsPattern *pattern);
+
+/**
+ Function releases scratch.
+ */
+APS_API void apsScratchFree(apsScratch *scratch);
+
+/**
+ Function searches buffer of caller. It allocates nothing, all its state is in scratch. Returns number of occurances, up to the one, where callback stopped search.
+ pattern            - compiled patterns
+ scratch            - scratch of this thread made for pattern
+ text               - haystack, it does not have to be zero terminated
+ size               - length of text
+ callback           - function called for every occurance, NULL only counts them
+ context            - passed to callback
+ */
+APS_API unsigned long apsSearch(const apsPattern *pattern, apsScratch *scratch, const char *text, unsigned long size, apsCallback callback, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
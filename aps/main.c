@@ -10,27 +10,124 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifdef __linux__
+// O_DIRECT of direct strategy
+#define _GNU_SOURCE
+#endif
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define APS_X86 1
+#endif
+#ifndef APS_LIBRARY
+#ifdef __APPLE__
 #include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+#include "aps.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 #define OPTIMAL_NUMBER_OF_THREADS 2048
 #define MIN_PART_SIZE_FACTOR 4
 #define NEWLINE '\n'
+#define MIN_LINE_INDEX_PART_SIZE (1024 * 1024)
+#define RESULT_BUFFER_SIZE 4096
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_VECTORS 256
+#define OUTPUT_COPY_SIZE 256
+#define MAX_PART_SIZE (16 * 1024 * 1024)
+#define STOP_PART_SIZE (1024 * 1024)
+#define MIN_SKIP_PATTERN_SIZE 16
+#define COMMON_BYTE_FREQUENCY 245
+#define MIN_PERIODIC_REPEATS 4
+#define AHO_OUTPUT 0x80000000u
+#define FILE_BATCH_SIZE (1024 * 1024)
+#define FILE_PART_SIZE (8 * 1024 * 1024)
+#define STREAM_BLOCK_SIZE (4 * 1024 * 1024)
+#define STREAM_LINE_SIZE (1024 * 1024)
+#define IO_MMAP 0
+#define IO_SEQUENTIAL 1
+#define IO_HUGE 2
+#define IO_POPULATE 3
+#define IO_READ 4
+#define IO_DIRECT 5
+#define IO_STRATEGIES 6
+#define IO_ALIGNMENT 4096
+#define FOLLOW_INTERVAL 1
+#define FOLLOW_EVENTS_SIZE 4096
+#define FOLLOW_MAGIC "APSFOLLOW1"
+#define OPENCL_WINDOW_SIZE (64 * 1024 * 1024)
+#define OPENCL_TILE_SIZE 4096
+#define OPENCL_GROUP_SIZE 256
+#define OPENCL_MIN_GROUP_SIZE 16
+#define OPENCL_MAX_THREADS 16384
+#define OPENCL_CALIBRATION_SIZE (4 * 1024 * 1024)
+#define OPENCL_PATTERN_CLASSES 3
+#define HYBRID_MIN_CHUNK (1024 * 1024)
+#define HYBRID_HOST 0
+#define HYBRID_DEVICE 1
+#define INDEX_BLOCK_SIZE (64 * 1024)
+#define INDEX_TRIGRAMS (1 << 24)
+#define INDEX_PATTERN_TRIGRAMS 8
+#define INDEX_MAGIC "APSIDX2"
+#define INDEX_EXTENSION ".apsidx"
+#ifdef __APPLE__
+#define STAT_MTIME_NSEC(sbuf) ((sbuf).st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(sbuf) ((sbuf).st_mtim.tv_nsec)
+#endif
+#define PATTERN_IGNORE_CASE APS_IGNORE_CASE
+#define PATTERN_WILDCARDS APS_WILDCARDS
+#define PATTERN_EDITS APS_EDITS
+#define SHIFT_OR_MAX_PATTERN 64
+#define WILDCARD '?'
+#define ASCII_CASE 0x20
+#define PROFILE_LOAD 0
+#define PROFILE_PATTERN 1
+#define PROFILE_DEVICE 2
+#define PROFILE_KERNEL 3
+#define PROFILE_READBACK 4
+#define PROFILE_LINES 5
+#define PROFILE_SEARCH 6
+#define PROFILE_OUTPUT 7
+#define PROFILE_PHASES 8
+#define PROFILE_COUNTERS 3
+#define BENCH_MAX_LENGTHS 16
+#define BENCH_MAX_RUNS 1000
+#define BENCH_LINE_SIZE 80
+#define BENCH_SEED 0x9E3779B97F4A7C15ull
+#define BENCH_ALPHABET "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,;:!?-_()[]{}<>/\\|@#$%^&*+=~'\"`"
 
 /**
  Function for calculating prefix of pattern we are trying to find with KMP algorithm. Parameters are pattern and pattern length.
  */
-int *compute_prefix_function(char *pattern, unsigned long psize)
+static int *compute_prefix_function(char *pattern, unsigned long psize)
 {
     int k = -1;
     int i = 1;
@@ -50,327 +147,4416 @@ int *compute_prefix_function(char *pattern, unsigned long psize)
 }
 
 /**
- Function returns what line character is on. It takes:
- newLines       - array of longs, which holds offsets of new line characters (\n).
- max            - size of newLines array
- charNum        - offset of character we want to find
- bonds          - array of two longs, where we can store bonds of line
+ Work of one worker, profile shows from them, whether parts were balanced. Device is one worker, which searches windows.
  */
-unsigned long findWhatLine(unsigned long *newLines, int max, unsigned long charNum, unsigned long *bonds) {
-    for (int i = 1; i < max-1; i++) {
-        if (*(newLines + i) <= charNum && charNum < *(newLines + i + 1)){
-            bonds[0] = *(newLines + i);
-            bonds[1] = *(newLines + i + 1);
-            return i;
-        }
+typedef struct {
+    const char *engine;             // host or device
+    unsigned long bytes;            // searched bytes without overlap of parts
+    unsigned long matches;          // occurances found by matcher, also ones skipped by sink
+    unsigned long parts;
+    unsigned long long busy;        // nanoseconds in matcher
+} profileWorker;
+
+/**
+ Profile of one search with -d. Phases are measured by monotonic clock, phases of workers (search and output) are added up from all of them, so they can be longer than search. Hardware counters are counted for whole process with all its threads by perf_event_open, where it is allowed.
+ */
+typedef struct {
+    int enabled;
+    unsigned long long phases[PROFILE_PHASES];  // nanoseconds of every phase
+    profileWorker *workers;
+    unsigned long numberOfWorkers;
+    pthread_mutex_t lock;
+    int counters[PROFILE_COUNTERS]; // descriptors of perf events, -1 when counter is not available
+} profileReport;
+
+static profileReport profile = {0, {0}, NULL, 0, PTHREAD_MUTEX_INITIALIZER, {-1, -1, -1}};
+#ifndef APS_LIBRARY
+static const char *profilePhases[PROFILE_PHASES] = {"load", "pattern", "device", "kernel", "readback", "lines", "search", "output"};
+static const char *profileCounters[PROFILE_COUNTERS] = {"cycles", "cache_misses", "page_faults"};
+#endif
+
+/**
+ Function returns monotonic time in nanoseconds, 0 when profile is off, so probes cost only one test.
+ */
+static unsigned long long profileNow(void) {
+    struct timespec now;
+    
+    if (!profile.enabled) {
+        return 0;
     }
-    bonds[0] = *(newLines + max - 1);
-    bonds[1] = *(newLines + max);
-    return max - 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
+/**
+ Function adds time from since (from profileNow) to phase. Workers add to the same phase at once.
+ */
+static void profileAdd(int phase, unsigned long long since) {
+    if (profile.enabled) {
+        __sync_fetch_and_add(&profile.phases[phase], profileNow() - since);
+    }
+}
 
+#ifndef APS_LIBRARY
 /**
- Function prints out results from both CPU singlethreaded or multithreaded calculation.
- text_source        - is haystack, where we want to find pattern (needle)
- text_source_size   - length of text_source
- result             - array of unsigned longs with results, they might be in uninterupted array or they might be splitted into more arrays, but then they have to have -1 at the end of each one.
- resultSize         - total length of result array
- partSize           - size of one part in result array
- linesOption        - type of output true for printing out lines
- offsetOption       - type of output true for printing out offset
+ Function adds work of finished worker to profile.
  */
-void printResult(char* text_source, unsigned long text_source_size, unsigned long *result, unsigned long resultSize, unsigned long partSize, int linesOption, int offsetOption) {
-    
-    
-    bool firsPart = true;
-    int numberOfFinds = 0;
-    
-    
-    if (linesOption || offsetOption){
-        unsigned long *newLines = (unsigned long*)malloc(text_source_size * sizeof(unsigned long));
-        //set first line to 0
-        newLines[1] = 0;
-        
-        //counter begins with 2, because of finding first linebreak is actually linebreak to 2nd line
-        int counter = 2;
-        
-        for(unsigned long j = 0; j < text_source_size; j++) {
-            if (text_source[j] == NEWLINE) {
-                newLines[counter] = j;
-                counter++;
-            }
-        }
-        //set last line to end of file
-        newLines[counter] = text_source_size;
-        
-        
-        unsigned long lineNumber;
-        unsigned long lineBonds[] = {0, 0};
-        
-        
-        for (unsigned long i = 0; i < resultSize; i++) {
-            //  when result is -1 we can jump to next part. when result is 0 and it is not in the first part, it is also jumping as a fail safe, because of last part, when its not divisible by partSize
-            if (result[i] == -1 || (result[i] == 0 && !firsPart)){
-                i = (i / partSize + 1) * partSize - 1;
-                firsPart = false;
-                continue;
-            }
-            numberOfFinds++;
-            if (offsetOption) {
-                printf("Offset %lu\n", result[i] + 1);
-            }
-            if (!linesOption){
-                continue;
-            }
-            if (result[i] < lineBonds[0] || result[i] > lineBonds[1]){
-                lineNumber = findWhatLine(newLines, counter, result[i], lineBonds);
-                printf("Line %lu:", lineNumber);
-                printf ("%.*s\n", lineBonds[1] - lineBonds[0], &(text_source[lineBonds[0]]));
-            }
-        }
-    } else {
-        for (unsigned long i = 0; i < resultSize; i++) {
-            if (result[i] == -1 || (result[i] == 0 && !firsPart)){
-                i = (i / partSize + 1) * partSize - 1;
-                firsPart = false;
-                continue;
-            }
-            numberOfFinds++;
-        }
+static void profileWorkerDone(const profileWorker *worker) {
+    if (!profile.enabled) {
+        return;
     }
-    
-    if (numberOfFinds > 0) {
-        printf("\nNumber of matches: %d\n", numberOfFinds);
-    }else {
-        printf("No match in file\n");
+    pthread_mutex_lock(&profile.lock);
+    profileWorker *resized = realloc(profile.workers, (profile.numberOfWorkers + 1) * sizeof(profileWorker));
+    if (resized) {
+        profile.workers = resized;
+        profile.workers[profile.numberOfWorkers++] = *worker;
     }
+    pthread_mutex_unlock(&profile.lock);
 }
 
 /**
- Function for searching string in string using KMP algorithm. Returns all occurances and their offset from beginning.
- text_source        - haystack array of characters.
- text_source_size   - text_source length
- pattern            - needle that we are trying to find
- results            - array of longs, where we are setting results
+ Function opens one counter of perf_event_open for this process and threads it creates later. Returns descriptor, -1 when counter is not available.
  */
-void findStringSingleThread(char* text_source,
-                   unsigned long text_source_size,
-                   char* pattern,
-                   unsigned long results[]) {
-    int i;
-    int k = -1;
-    int counter = 0;
-    unsigned long pattern_size = strlen(pattern);
-    int *pi = compute_prefix_function(pattern, pattern_size);
+static int profileCounterOpen(uint32_t type, uint64_t config) {
+#ifdef __linux__
+    struct perf_event_attr attr;
     
-    if (!pi){
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    // without privileges only user space can be counted, page faults are counted by kernel for user space
+    attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ Function starts profile of search, when it is enabled by -d. Counters count from here until profilePrint.
+ */
+static void profileStart(int enabled) {
+    // counters of search, which failed before its report, are closed
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        if (profile.counters[c] >= 0) {
+            close(profile.counters[c]);
+            profile.counters[c] = -1;
+        }
+    }
+    free(profile.workers);
+    profile.workers = NULL;
+    profile.numberOfWorkers = 0;
+    memset(profile.phases, 0, sizeof(profile.phases));
+    profile.enabled = enabled;
+    if (!enabled) {
         return;
     }
-    
-    for (i = 0; i < text_source_size; i++) {
-        while (k > -1 && pattern[k+1] != text_source[i])
-            k = pi[k];
-        if (text_source[i] == pattern[k+1])
-            k++;
-        if (k == pattern_size - 1) {
-            results[counter] = i - k;
-            counter++;
-            k = -1;
+#ifdef __linux__
+    profile.counters[0] = profileCounterOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    profile.counters[1] = profileCounterOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    profile.counters[2] = profileCounterOpen(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+#endif
+}
+
+/**
+ Function prints out phases, workers and counters as members of JSON object, which caller opened, closes it and turns profile off. Counter, which is not available, is null.
+ */
+static void profilePrint(void) {
+    printf("  \"phases_ms\": {");
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        printf("%s\"%s\": %.3f", p ? ", " : "", profilePhases[p], profile.phases[p] / 1e6);
+    }
+    printf("},\n  \"workers\": [");
+    for (unsigned long w = 0; w < profile.numberOfWorkers; w++) {
+        const profileWorker *worker = &profile.workers[w];
+        printf("%s\n    {\"engine\": \"%s\", \"bytes\": %lu, \"matches\": %lu, \"parts\": %lu, \"busy_ms\": %.3f}", w ? "," : "", worker->engine, worker->bytes, worker->matches, worker->parts, worker->busy / 1e6);
+    }
+    printf("%s],\n  \"counters\": {", profile.numberOfWorkers ? "\n  " : "");
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        uint64_t value;
+        int fd = profile.counters[c];
+        printf("%s\"%s\": ", c ? ", " : "", profileCounters[c]);
+        if (fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value)) {
+            printf("%llu", (unsigned long long)value);
+        } else {
+            printf("null");
+        }
+        if (fd >= 0) {
+            close(fd);
         }
+        profile.counters[c] = -1;
     }
-    results[counter] = -1;
+    printf("}\n}\n");
+    profile.enabled = 0;
+}
+#endif
 
-    return;
-    
+/**
+ Index of lines of haystack. It holds ordered offsets of all new line characters (\n), so line of any offset is found by binary search. Memory depends on number of lines, not on size of haystack.
+ */
+typedef struct {
+    char *text_source;
+    unsigned long text_source_size;
+    unsigned long *newLines;        // ordered offsets of new line characters
+    unsigned long numberOfNewLines;
+    unsigned long lastOffset;       // offset of last lookup
+    unsigned long cursor;           // index of first new line character after lastOffset
+} lineIndex;
+
+/**
+ Everything one thread building line index needs. Every thread scans its own part of haystack.
+ */
+typedef struct {
+    lineIndex *index;
+    unsigned long begin;            // part of haystack from begin to end
+    unsigned long end;
+    unsigned long numberOfNewLines; // new lines in part, after counting it is first index of part in newLines
+} lineIndexPart;
 
+/**
+ Thread function counting new line characters in its part. memchr is vectorized in libc, so it is much faster than comparing byte by byte.
+ */
+static void *lineIndexCount(void *arg) {
+    lineIndexPart *part = (lineIndexPart *)arg;
+    char *text_source = part->index->text_source;
+    char *position = text_source + part->begin;
+    char *end = text_source + part->end;
+    unsigned long counter = 0;
+    
+    while (position < end && (position = memchr(position, NEWLINE, end - position))) {
+        counter++;
+        position++;
+    }
+    part->numberOfNewLines = counter;
+    return NULL;
 }
 
+/**
+ Thread function writing offsets of new line characters in its part from its first index in newLines.
+ */
+static void *lineIndexFill(void *arg) {
+    lineIndexPart *part = (lineIndexPart *)arg;
+    char *text_source = part->index->text_source;
+    char *position = text_source + part->begin;
+    char *end = text_source + part->end;
+    unsigned long *newLines = part->index->newLines + part->numberOfNewLines;
+    
+    while (position < end && (position = memchr(position, NEWLINE, end - position))) {
+        *newLines = position - text_source;
+        newLines++;
+        position++;
+    }
+    return NULL;
+}
 
 /**
- Function for searching string in string using KMP algorithm using OpenCL multithreading. Returns all occurances and their offset from beginning.
- device_id          - cl_device_id returned from OpenCL API call
- context            - cl_command_queue queue into which program is set
- program            - cl_program built program
- kernel             - cl_kernel the compute kernel in the program we wish to run
+ Function builds index of lines. Haystack is split between threads, each one counts new lines in its part, counts are turned into first indexes by prefix sum and then each thread writes its new lines on its place.
+ index              - index we are building
  text_source        - haystack array of characters
  text_source_size   - length of text_source
- pattern            - needle that we are trying to find array of char
- results            - array of longs, where we are setting results
- resultsSize        - length of results array
- partSize           - pointer to unsigned long variable, where we set size of one part
- */
-size_t findStringMultiThread(cl_device_id device_id,
-                cl_context context,
-                cl_command_queue commands,
-                cl_program program,
-                cl_kernel kernel,
-                char* text_source,
-                unsigned long text_source_size,
-                char* pattern,
-                unsigned long results[],
-                unsigned long resultSize,
-                unsigned long *partSize) {
-   
-    int err;                            // error code returned from api calls
-    
-    
-    cl_mem input;                       // device memory used for the input array
-    cl_mem patternMem;                  // device memory used for the pattern array
-    cl_mem computePatternMem;
-    cl_mem output;                      // device memory used for the output array
-    
-    
+ numOfWorkers       - number of threads, 0 means number of online processors
+ */
+static void lineIndexBuild(lineIndex *index, char *text_source, unsigned long text_source_size, size_t numOfWorkers) {
+    memset(index, 0, sizeof(lineIndex));
+    index->text_source = text_source;
+    index->text_source_size = text_source_size;
     
-
-    if (text_source_size == 0) {
-        printf("Error: Text file is empty!");
-        exit(1);
+    if (numOfWorkers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numOfWorkers = online > 0 ? online : 1;
     }
-    
-    unsigned long pattern_size = strlen(pattern);
-    
-    if (pattern_size == 0) {
-        printf("Error: Pattern is empty!");
-        exit(1);
+    // small files are not worth of threads
+    if (text_source_size / MIN_LINE_INDEX_PART_SIZE < numOfWorkers) {
+        numOfWorkers = text_source_size / MIN_LINE_INDEX_PART_SIZE;
     }
-    
-    if (pattern_size > text_source_size) {
-        printf("Error: Pattern is longer than text in text file!");
-        exit(1);
+    if (numOfWorkers == 0) {
+        numOfWorkers = 1;
     }
     
-    
-    
-    
-    
-   
-    
-    // Create the input and output arrays in device memory for our calculation
-    //
-    int error = 0;
-    
-    input = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(char) * text_source_size, text_source, &error);
-    if (error)
-    {
-        printf("Error: Failed to allocate device memory with code %d!\n", error);
+    lineIndexPart *parts = calloc(numOfWorkers, sizeof(lineIndexPart));
+    pthread_t *threads = malloc(numOfWorkers * sizeof(pthread_t));
+    if (!parts || !threads) {
+        printf("Error: Failed to allocate memory for lines!\n");
         exit(1);
     }
+    unsigned long partSize = text_source_size / numOfWorkers;
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        parts[w].index = index;
+        parts[w].begin = w * partSize;
+        parts[w].end = w == numOfWorkers - 1 ? text_source_size : (w + 1) * partSize;
+    }
     
-    patternMem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(char) * pattern_size, pattern, &error);
-    if (error)
-    {
-        printf("Error: Failed to allocate device memory with code %d!\n", error);
-        exit(1);
+    for (size_t w = 1; w < numOfWorkers; w++) {
+        if (pthread_create(&threads[w], NULL, lineIndexCount, &parts[w]) != 0) {
+            printf("Error: Failed to create worker thread!\n");
+            exit(1);
+        }
     }
-    int *pi = compute_prefix_function(pattern, pattern_size);
-    computePatternMem = clCreateBuffer(context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(int) * pattern_size, pi, &error);
-    if (error)
-    {
-        printf("Error: Failed to allocate device memory with code %d!\n", error);
-        exit(1);
+    lineIndexCount(&parts[0]);
+    for (size_t w = 1; w < numOfWorkers; w++) {
+        pthread_join(threads[w], NULL);
     }
     
-    output = clCreateBuffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, resultSize * sizeof(long), results, &error);
-    if (error)
-    {
-        printf("Error: Failed to allocate device memory with code %d!\n", error);
+    // exclusive prefix sum of counts gives each part its first index in newLines
+    unsigned long total = 0;
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        unsigned long count = parts[w].numberOfNewLines;
+        parts[w].numberOfNewLines = total;
+        total += count;
+    }
+    index->numberOfNewLines = total;
+    index->newLines = malloc((total + 1) * sizeof(unsigned long));
+    if (!index->newLines) {
+        printf("Error: Failed to allocate memory for lines!\n");
         exit(1);
     }
     
-    results = clEnqueueMapBuffer(commands, output, CL_TRUE, CL_MAP_WRITE, 0, resultSize * sizeof(unsigned long), 0, NULL, NULL, NULL);
-    
+    for (size_t w = 1; w < numOfWorkers; w++) {
+        if (pthread_create(&threads[w], NULL, lineIndexFill, &parts[w]) != 0) {
+            printf("Error: Failed to create worker thread!\n");
+            exit(1);
+        }
+    }
+    lineIndexFill(&parts[0]);
+    for (size_t w = 1; w < numOfWorkers; w++) {
+        pthread_join(threads[w], NULL);
+    }
     
-    // Set the arguments to our compute kernel
-    //
+    free(threads);
+    free(parts);
+}
+
+/**
+ Function returns number of line (from 1), which character is on, and sets bonds of that line without new line character. Offsets mostly come ordered, so lookup gallops forward from previous one and falls back to binary search over whole index only when offset goes back.
+ index              - index of lines
+ charNum            - offset of character we want to find
+ bonds              - array of two longs, where we set beginning and end of line
+ */
+static unsigned long lineIndexFind(lineIndex *index, unsigned long charNum, unsigned long *bonds) {
+    unsigned long low = 0;
+    unsigned long high = index->numberOfNewLines;
     
-    err = 0;
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
-    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &patternMem);
-    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &computePatternMem);
-    err |= clSetKernelArg(kernel, 4, sizeof(unsigned long), &pattern_size);
-    err |= clSetKernelArg(kernel, 5, sizeof(unsigned long), &text_source_size);
+    if (charNum >= index->lastOffset) {
+        // gallop from cursor until new line character after charNum is in range
+        unsigned long step = 1;
+        low = index->cursor;
+        while (low + step < high && index->newLines[low + step] < charNum) {
+            low += step;
+            step *= 2;
+        }
+        if (low + step < high) {
+            high = low + step + 1;
+        }
+    }
+    // first new line character, which is not before charNum
+    while (low < high) {
+        unsigned long middle = low + (high - low) / 2;
+        if (index->newLines[middle] < charNum) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    index->lastOffset = charNum;
+    index->cursor = low;
     
+    bonds[0] = low == 0 ? 0 : index->newLines[low - 1] + 1;
+    bonds[1] = low == index->numberOfNewLines ? index->text_source_size : index->newLines[low];
+    return low + 1;
+}
+
+/**
+ Function sets bonds of line without new line character. Returns 0, when there is no such line.
+ index              - index of lines
+ line               - number of line (from 1)
+ bonds              - array of two longs, where we set beginning and end of line
+ */
+static int lineIndexBonds(const lineIndex *index, unsigned long line, unsigned long *bonds) {
+    if (line == 0 || line > index->numberOfNewLines + 1) {
+        return 0;
+    }
+    bonds[0] = line == 1 ? 0 : index->newLines[line - 2] + 1;
+    bonds[1] = line > index->numberOfNewLines ? index->text_source_size : index->newLines[line - 1];
+    // after last new line character there is line only, when something follows it
+    return line <= index->numberOfNewLines || bonds[0] < bonds[1];
+}
+
+/**
+ Function releases index of lines.
+ */
+static void lineIndexFree(lineIndex *index) {
+    free(index->newLines);
+    index->newLines = NULL;
+}
+
+
+/**
+ Writer of results to stdout. Formatted text is collected in one reusable buffer and long lines are only referenced in haystack, so they go from mapped file to output without copying. Everything is written by one writev, when buffer or vectors are full, and at the end. Every result is reserved whole before it is formatted, so results are never split between two writes.
+ */
+typedef struct {
+    char *buffer;                   // formatted text, it is allocated with first result
+    unsigned long size;             // used part of buffer
+    struct iovec vectors[OUTPUT_VECTORS];
+    int numberOfVectors;
+} outputWriter;
+
+// writers of more files searched at once write one after another, so their writes are not mixed in pipe
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+// errno of failed write to stdout, all writers drop their results until it is reported by outputCheck
+static int outputError = 0;
+
+/**
+ Function writes everything collected in writer. Text printed by printf before goes out first. After failed write (like ENOSPC or EIO) results are dropped, the rest of output would have hole anyway.
+ */
+static void outputFlush(outputWriter *output) {
+    struct iovec *vector = output->vectors;
+    int count = output->numberOfVectors;
     
-    if (err != CL_SUCCESS)
-    {
-        printf("Error: Failed to set kernel arguments! %d\n", err);
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&outputLock);
+    fflush(stdout);
+    while (count > 0 && !outputError) {
+        ssize_t written = writev(STDOUT_FILENO, vector, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            outputError = errno;
+            break;
+        }
+        // writev can write only beginning of vectors
+        while (count > 0 && (size_t)written >= vector->iov_len) {
+            written -= vector->iov_len;
+            vector++;
+            count--;
+        }
+        if (count > 0) {
+            vector->iov_base = (char *)vector->iov_base + written;
+            vector->iov_len -= written;
+        }
+    }
+    pthread_mutex_unlock(&outputLock);
+    output->size = 0;
+    output->numberOfVectors = 0;
+}
+
+/**
+ Function makes room for one result, which has at most size bytes of formatted text and numberOfVectors slices.
+ */
+static void outputReserve(outputWriter *output, unsigned long size, int numberOfVectors) {
+    if (!output->buffer && !(output->buffer = malloc(OUTPUT_BUFFER_SIZE))) {
+        printf("Error: Failed to allocate memory for results!\n");
         exit(1);
     }
-    
-    
-    // Compute number of workers (threads) for this text file
-    unsigned long tmp = round(text_source_size / OPTIMAL_NUMBER_OF_THREADS) + 1;
-    size_t global = text_source_size / tmp;
-    
-    
-    if ((text_source_size / (pattern_size * MIN_PART_SIZE_FACTOR)) < global) {
-        global = (text_source_size / (pattern_size * MIN_PART_SIZE_FACTOR)) ;
+    if (output->size + size > OUTPUT_BUFFER_SIZE || output->numberOfVectors + numberOfVectors > OUTPUT_VECTORS) {
+        outputFlush(output);
     }
-    *partSize = text_source_size / global;
-    
-    // Execute the kernel over the entire range of our 1d input data set
-    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
-    
-    if (err)
-    {
-        printf("Error: Failed to execute kernel!\n");
-        exit(EXIT_FAILURE);
+}
+
+/**
+ Function copies text into buffer of writer. Text next to previous one in buffer extends its vector.
+ */
+static void outputAppend(outputWriter *output, const char *text, unsigned long size) {
+    outputReserve(output, size, 1);
+    if (size > OUTPUT_BUFFER_SIZE) {
+        size = OUTPUT_BUFFER_SIZE;
+    }
+    memcpy(output->buffer + output->size, text, size);
+    struct iovec *last = output->numberOfVectors ? &output->vectors[output->numberOfVectors - 1] : NULL;
+    if (last && (char *)last->iov_base + last->iov_len == output->buffer + output->size) {
+        last->iov_len += size;
+    } else {
+        output->vectors[output->numberOfVectors].iov_base = output->buffer + output->size;
+        output->vectors[output->numberOfVectors].iov_len = size;
+        output->numberOfVectors++;
+    }
+    output->size += size;
+}
+
+/**
+ Function adds slice of haystack. Short slice is copied, long one is written right from haystack, so haystack has to stay mapped until writer is flushed.
+ */
+static void outputSlice(outputWriter *output, const char *text, unsigned long size) {
+    if (size < OUTPUT_COPY_SIZE) {
+        outputAppend(output, text, size);
+        return;
     }
+    outputReserve(output, 0, 1);
+    output->vectors[output->numberOfVectors].iov_base = (char *)text;
+    output->vectors[output->numberOfVectors].iov_len = size;
+    output->numberOfVectors++;
+}
+
+/**
+ Function adds decimal number.
+ */
+static void outputNumber(outputWriter *output, unsigned long number) {
+    char digits[24];
+    int i = sizeof(digits);
     
-    // Wait for the command commands to get serviced before reading back results
-    //
+    do {
+        digits[--i] = '0' + number % 10;
+        number /= 10;
+    } while (number);
+    outputAppend(output, digits + i, sizeof(digits) - i);
+}
+
+/**
+ Function writes rest of results and releases writer.
+ */
+static void outputFree(outputWriter *output) {
+    outputFlush(output);
+    free(output->buffer);
+    output->buffer = NULL;
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function returns errno of failed write of results or of text printed by printf and forgets it, so next served query writes again. Returns 0, when everything was written.
+ */
+static int outputCheck(void) {
+    int error;
     
-    clFinish(commands);
+    pthread_mutex_lock(&outputLock);
+    if ((fflush(stdout) != 0 || ferror(stdout)) && !outputError) {
+        outputError = errno ? errno : EIO;
+    }
+    clearerr(stdout);
+    error = outputError;
+    outputError = 0;
+    pthread_mutex_unlock(&outputLock);
+    return error;
+}
+#endif
+
+
+/**
+ Sink, which receives results from all searches and prints them out or counts them. Results are coming in bounded buffers, so memory does not depend on size of haystack. Every buffer belongs to one part of haystack and parts are written in order, so output stays ordered even with more workers.
+ Searches write all occurances, also overlapping ones, and sink takes from them the same occurances single pass of KMP would find: the first one and then always the first one after end of previous. So results do not depend on how haystack was split into parts. With more patterns it is done for every pattern alone, so results are the same as of separate searches for every pattern.
+ */
+typedef struct {
+    const char *name;               // name of file, which is printed before every result, NULL for only one file
+    char *text_source;              // haystack, where we want to find pattern (needle), for stream only its current block
+    unsigned long text_source_size; // length of text_source
+    unsigned long textOffset;       // offset of text_source in stream, 0 for file
+    unsigned long lineOffset;       // number of lines in stream before text_source, 0 for file
+    unsigned long textLimit;        // results from here are left for the next block of stream
+    int linesOption;                // type of output true for printing out lines
+    int offsetOption;               // type of output true for printing out offset
+    int countOption;                // searches only count occurances and never write offsets
+    int quiet;                      // nothing is printed out, only numberOfFinds is known
+    unsigned long maxFinds;         // search stops after so many occurances, 0 for no limit
+    volatile int cancelled;         // maxFinds was reached, workers do not take next parts
+    unsigned long numberOfFinds;
+    char **patterns;                // needles, results are tagged with their index
+    unsigned long numberOfPatterns;
+    unsigned long *patternSizes;    // length of every pattern
+    unsigned long *patternFinds;    // number of occurances of every pattern
+    unsigned long *nextStart;       // end of last occurance of every pattern, occurances overlapping it are skipped
     
+    lineIndex lines;                // index of lines, only for linesOption
+    unsigned long lastLine;         // number of last printed line, so line with more occurances is printed once
+    unsigned long before;           // lines of context printed before line with occurance
+    unsigned long after;            // lines of context printed after line with occurance
+    unsigned long afterLine;        // last line of context after last printed occurance
+    outputWriter output;
+    apsCallback callback;           // library search calls it for every occurance instead of printing, NULL otherwise
+    void *context;                  // context of callback
     
+    pthread_mutex_t lock;
+    pthread_cond_t partDone;
+    unsigned long currentPart;      // part, which is allowed to write now
+} resultSink;
+
+/**
+ One occurance of pattern.
+ */
+typedef struct {
+    unsigned long offset;           // offset from beginning of haystack
+    unsigned long pattern;          // index of pattern in sink->patterns
+} searchResult;
+
+/**
+ Bounded buffer of results of one worker. When it is full, it is drained into sink.
+ In count mode it only counts occurances of every pattern, see bufferInitCount.
+ */
+typedef struct {
+    searchResult results[RESULT_BUFFER_SIZE];
+    unsigned long count;
+    unsigned long part;             // part of haystack, which results are in buffer
+    resultSink *sink;
+    unsigned long *counts;          // number of occurances of every pattern in count mode, NULL otherwise
+} resultBuffer;
+
+/**
+ Function prepares sink for results of one haystack.
+ sink               - sink we are preparing
+ text_source        - is haystack, where we want to find pattern (needle), NULL for stream (see sinkSetText)
+ text_source_size   - length of text_source
+ patterns           - needles that we are trying to find
+ numberOfPatterns   - length of patterns
+ linesOption        - type of output true for printing out lines
+ offsetOption       - type of output true for printing out offset
+ countOption        - type of output true for printing out only number of occurances, it wins over linesOption and offsetOption
+ numOfWorkers       - number of threads for building index of lines, 0 means number of online processors
+ Returns 0 on success, -1 when there is not enough memory for results.
+ */
+static int sinkInit(resultSink *sink, char* text_source, unsigned long text_source_size, char **patterns, unsigned long numberOfPatterns, int linesOption, int offsetOption, int countOption, size_t numOfWorkers) {
+    memset(sink, 0, sizeof(resultSink));
+    sink->text_source = text_source;
+    sink->text_source_size = text_source_size;
+    sink->patterns = patterns;
+    sink->numberOfPatterns = numberOfPatterns;
+    sink->patternSizes = malloc(numberOfPatterns * sizeof(unsigned long));
+    sink->patternFinds = calloc(numberOfPatterns, sizeof(unsigned long));
+    sink->nextStart = calloc(numberOfPatterns, sizeof(unsigned long));
+    sink->textLimit = (unsigned long)-1;
+    if (!sink->patternSizes || !sink->patternFinds || !sink->nextStart) {
+        free(sink->patternSizes);
+        free(sink->patternFinds);
+        free(sink->nextStart);
+        return -1;
+    }
+    for (unsigned long p = 0; p < numberOfPatterns; p++) {
+        sink->patternSizes[p] = strlen(patterns[p]);
+    }
+    sink->countOption = countOption || (!linesOption && !offsetOption);
+    sink->linesOption = linesOption && !sink->countOption;
+    sink->offsetOption = offsetOption && !sink->countOption;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->partDone, NULL);
     
-    // Read back the results from the device to verify the output
-    //
-    err = clEnqueueUnmapMemObject(commands, output, results, 0, NULL, NULL);
-    if (err != CL_SUCCESS)
-    {
-        printf("Error: Failed to read output array! %d\n", err);
-        exit(1);
+    if (sink->linesOption && text_source) {
+        unsigned long long begin = profileNow();
+        lineIndexBuild(&sink->lines, text_source, text_source_size, numOfWorkers);
+        profileAdd(PROFILE_LINES, begin);
     }
+    return 0;
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function sets lines of context, which are printed around every line with occurance like by grep -B and -A. Context lines are marked by - after their number instead of :, and groups of lines, which are not next to each other, are separated by --.
+ */
+static void sinkSetContext(resultSink *sink, unsigned long before, unsigned long after) {
+    sink->before = before;
+    sink->after = after;
+}
+
+/**
+ Function sets limit of occurances like grep -m. Occurances after maxFinds are not written and searches stop taking next parts, when it is reached, so search of big haystack takes about as long as search of its part up to last wanted occurance. Quiet sink prints out nothing at all, it only answers, whether there is some occurance (-q).
+ */
+static void sinkSetLimit(resultSink *sink, unsigned long maxFinds, int quiet) {
+    sink->maxFinds = maxFinds;
+    sink->quiet = quiet;
+}
+#endif
+
+/**
+ Function prints out one line of text of sink.
+ sink               - sink with lines
+ lineNumber         - number of line in whole haystack
+ bonds              - bonds of line in text of sink
+ mark               - : for line with occurance, - for context
+ */
+static void sinkLine(resultSink *sink, unsigned long lineNumber, unsigned long *bonds, char mark) {
+    outputWriter *output = &sink->output;
+    unsigned long nameLength = sink->name ? strlen(sink->name) : 0;
     
+    outputReserve(output, nameLength + 64 + OUTPUT_COPY_SIZE, 3);
+    if ((sink->before || sink->after) && sink->lastLine && lineNumber > sink->lastLine + 1) {
+        outputAppend(output, "--\n", 3);
+    }
+    if (sink->name) {
+        outputAppend(output, sink->name, nameLength);
+        outputAppend(output, ":", 1);
+    }
+    outputAppend(output, "Line ", 5);
+    outputNumber(output, lineNumber);
+    outputAppend(output, &mark, 1);
+    outputSlice(output, sink->text_source + bonds[0], bonds[1] - bonds[0]);
+    outputAppend(output, "\n", 1);
+    sink->lastLine = lineNumber;
+}
+
+/**
+ Function prints out lines of context after last line with occurance up to untilLine. Lines, which are not whole in text of sink, are left for its next text.
+ */
+static void sinkAfterContext(resultSink *sink, unsigned long untilLine) {
+    unsigned long bonds[2];
     
-    clReleaseMemObject(input);
-    clReleaseMemObject(output);
-    clReleaseMemObject(patternMem);
-    clReleaseMemObject(computePatternMem);
-    return global;
+    if (untilLine > sink->afterLine) {
+        untilLine = sink->afterLine;
+    }
+    while (sink->lastLine < untilLine) {
+        unsigned long line = sink->lastLine + 1;
+        if (line <= sink->lineOffset || !lineIndexBonds(&sink->lines, line - sink->lineOffset, bonds) || sink->textOffset + bonds[0] >= sink->textLimit) {
+            break;
+        }
+        sinkLine(sink, line, bonds, '-');
+    }
 }
 
-int main(int argc, char** argv)
-{
+/**
+ Function prints out lines of context before line with occurance, which were not printed yet.
+ */
+static void sinkBeforeContext(resultSink *sink, unsigned long lineNumber) {
+    unsigned long bonds[2];
+    unsigned long line = lineNumber > sink->before ? lineNumber - sink->before : 1;
     
-    // source string of kernel
-    const char* source_str =
-    "__kernel void kmp(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned long *output, unsigned long counter)"
-    "{"
-    "    unsigned long i;"
-    "    int k = -1;"
-    "    if (!pi){"
-    "        return;"
+    if (line <= sink->lastLine) {
+        line = sink->lastLine + 1;
+    }
+    if (line <= sink->lineOffset) {
+        line = sink->lineOffset + 1;
+    }
+    for (; line < lineNumber; line++) {
+        if (lineIndexBonds(&sink->lines, line - sink->lineOffset, bonds)) {
+            sinkLine(sink, line, bonds, '-');
+        }
+    }
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function writes out everything, what refers to current text of sink: lines of context after last occurance, which are in it, and slices of writer. Then text can be reused.
+ */
+static void sinkFlushText(resultSink *sink) {
+    unsigned long long begin = profileNow();
+    
+    if (sink->linesOption && sink->text_source) {
+        sinkAfterContext(sink, (unsigned long)-1);
+    }
+    outputFlush(&sink->output);
+    profileAdd(PROFILE_OUTPUT, begin);
+}
+
+/**
+ Function moves sink of stream to its next block. Results are still offsets from beginning of stream, so nextStart and lastLine work across blocks.
+ sink               - sink of stream
+ text_source        - current block
+ text_source_size   - length of text_source
+ textOffset         - offset of text_source in stream
+ lineOffset         - number of lines in stream before text_source
+ textLimit          - results from here are skipped, because they are searched again in the next block
+ */
+static void sinkSetText(resultSink *sink, char *text_source, unsigned long text_source_size, unsigned long textOffset, unsigned long lineOffset, unsigned long textLimit) {
+    sinkFlushText(sink);
+    sink->text_source = text_source;
+    sink->text_source_size = text_source_size;
+    sink->textOffset = textOffset;
+    sink->lineOffset = lineOffset;
+    sink->textLimit = textLimit;
+    if (sink->linesOption) {
+        lineIndexFree(&sink->lines);
+        lineIndexBuild(&sink->lines, text_source, text_source_size, 1);
+    }
+}
+#endif
+
+/**
+ Function prints out or counts results. Caller has to be the one allowed to write (see bufferDrain).
+ sink               - sink results are written into
+ results            - occurances, ordered for every pattern
+ count              - length of results
+ */
+static void sinkWrite(resultSink *sink, searchResult *results, unsigned long count) {
+    unsigned long lineNumber;
+    unsigned long lineBonds[2];
+    outputWriter *output = &sink->output;
+    unsigned long nameLength = sink->name ? strlen(sink->name) : 0;
+    unsigned long long begin = profileNow();
+    
+    for (unsigned long i = 0; i < count && !sink->cancelled; i++) {
+        unsigned long offset = results[i].offset;
+        unsigned long pattern = results[i].pattern;
+        
+        if (offset < sink->nextStart[pattern] || offset >= sink->textLimit) {
+            continue;
+        }
+        sink->nextStart[pattern] = offset + sink->patternSizes[pattern];
+        sink->patternFinds[pattern]++;
+        sink->numberOfFinds++;
+        if (sink->numberOfFinds == sink->maxFinds) {
+            // the last wanted occurance is still printed out
+            sink->cancelled = 1;
+        }
+        if (sink->callback) {
+            if (sink->callback(sink->context, offset, pattern)) {
+                sink->cancelled = 1;
+            }
+            continue;
+        }
+        lineNumber = 0;
+        if (sink->linesOption) {
+            // context of previous lines goes before offset of occurance
+            lineNumber = lineIndexFind(&sink->lines, offset - sink->textOffset, lineBonds) + sink->lineOffset;
+            if (lineNumber > sink->lastLine) {
+                sinkAfterContext(sink, lineNumber - 1);
+                sinkBeforeContext(sink, lineNumber);
+            }
+        }
+        if (sink->offsetOption) {
+            outputReserve(output, nameLength + 64, 1);
+            if (sink->name) {
+                outputAppend(output, sink->name, nameLength);
+                outputAppend(output, ":", 1);
+            }
+            outputAppend(output, "Offset ", 7);
+            outputNumber(output, offset + 1);
+            if (sink->numberOfPatterns > 1) {
+                outputAppend(output, " pattern ", 9);
+                outputNumber(output, pattern + 1);
+            }
+            outputAppend(output, "\n", 1);
+        }
+        if (lineNumber > sink->lastLine){
+            sinkLine(sink, lineNumber, lineBonds, ':');
+            sink->afterLine = lineNumber + sink->after;
+        }
+    }
+    profileAdd(PROFILE_OUTPUT, begin);
+}
+
+/**
+ Function adds numbers of occurances of every pattern found in count mode. Counts are not ordered, so caller does not have to wait for its part. It can be used only for patterns, which cannot overlap (see patternOverlaps), and with limit only for one pattern (see sinkCountOnly).
+ */
+static void sinkCount(resultSink *sink, unsigned long *counts) {
+    pthread_mutex_lock(&sink->lock);
+    for (unsigned long p = 0; p < sink->numberOfPatterns; p++) {
+        sink->patternFinds[p] += counts[p];
+        sink->numberOfFinds += counts[p];
+    }
+    if (sink->maxFinds && sink->numberOfFinds >= sink->maxFinds) {
+        sink->numberOfFinds = sink->patternFinds[0] = sink->maxFinds;
+        sink->cancelled = 1;
+    }
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/**
+ Function releases sink without printing anything.
+ */
+static void sinkFree(resultSink *sink) {
+    outputFree(&sink->output);
+    free(sink->patternSizes);
+    free(sink->patternFinds);
+    free(sink->nextStart);
+    lineIndexFree(&sink->lines);
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->partDone);
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function prints out number of matches and releases sink. Sink of one of more files prints nothing, when there is no match.
+ */
+static void sinkFinish(resultSink *sink) {
+    sinkFlushText(sink);
+    if (sink->quiet) {
+        // only number of finds is asked
+    } else if (sink->name) {
+        if (sink->numberOfFinds > 0) {
+            printf("%s:Number of matches: %lu\n", sink->name, sink->numberOfFinds);
+        }
+        for (unsigned long p = 0; p < sink->numberOfPatterns && sink->numberOfPatterns > 1 && sink->numberOfFinds > 0; p++) {
+            printf("%s:Pattern %lu (%s): %lu\n", sink->name, p + 1, sink->patterns[p], sink->patternFinds[p]);
+        }
+    } else if (sink->numberOfFinds > 0) {
+        printf("\nNumber of matches: %lu\n", sink->numberOfFinds);
+        for (unsigned long p = 0; p < sink->numberOfPatterns && sink->numberOfPatterns > 1; p++) {
+            printf("Pattern %lu (%s): %lu\n", p + 1, sink->patterns[p], sink->patternFinds[p]);
+        }
+    }else {
+        printf("No match in file\n");
+    }
+    sinkFree(sink);
+}
+#endif
+
+/**
+ Function prepares empty buffer for part of haystack.
+ */
+static void bufferInit(resultBuffer *buffer, resultSink *sink, unsigned long part) {
+    buffer->count = 0;
+    buffer->part = part;
+    buffer->sink = sink;
+    buffer->counts = NULL;
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function prepares buffer for count mode. Buffer does not keep any results, it only counts them for every pattern and it can be used for more parts, because counts are not ordered. Counts are added to sink by bufferFinishCount. Returns 0 on success.
+ */
+static int bufferInitCount(resultBuffer *buffer, resultSink *sink) {
+    bufferInit(buffer, sink, 0);
+    buffer->counts = calloc(sink->numberOfPatterns, sizeof(unsigned long));
+    return buffer->counts ? 0 : -1;
+}
+
+#endif
+
+/**
+ Function adds counts of buffer in count mode to sink and starts counting again from zero. It is called after every part, so limit of sink is known to be reached before next part is taken.
+ */
+static void bufferFlushCount(resultBuffer *buffer) {
+    sinkCount(buffer->sink, buffer->counts);
+    memset(buffer->counts, 0, buffer->sink->numberOfPatterns * sizeof(unsigned long));
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function adds counts of buffer in count mode to sink.
+ */
+static void bufferFinishCount(resultBuffer *buffer) {
+    bufferFlushCount(buffer);
+    free(buffer->counts);
+    buffer->counts = NULL;
+}
+#endif
+
+/**
+ Function drains buffer into sink. It waits until all previous parts are finished, so results are written in order.
+ */
+static void bufferDrain(resultBuffer *buffer) {
+    resultSink *sink = buffer->sink;
+    
+    pthread_mutex_lock(&sink->lock);
+    while (sink->currentPart != buffer->part) {
+        pthread_cond_wait(&sink->partDone, &sink->lock);
+    }
+    sinkWrite(sink, buffer->results, buffer->count);
+    buffer->count = 0;
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/**
+ Function adds one result into buffer and drains it, when it is full.
+ buffer             - buffer of part
+ offset             - offset of occurance from beginning of haystack
+ pattern            - index of pattern, which occurs there
+ */
+static void bufferPush(resultBuffer *buffer, unsigned long offset, unsigned long pattern) {
+    if (buffer->counts) {
+        buffer->counts[pattern]++;
+        return;
+    }
+    buffer->results[buffer->count].offset = offset;
+    buffer->results[buffer->count].pattern = pattern;
+    buffer->count++;
+    if (buffer->count == RESULT_BUFFER_SIZE) {
+        bufferDrain(buffer);
+    }
+}
+
+/**
+ Function drains rest of buffer and lets next part write into sink.
+ */
+static void bufferFinish(resultBuffer *buffer) {
+    resultSink *sink = buffer->sink;
+    
+    bufferDrain(buffer);
+    pthread_mutex_lock(&sink->lock);
+    sink->currentPart++;
+    pthread_cond_broadcast(&sink->partDone);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/**
+ Function returns true, when pattern can overlap with itself, for example "aba" in "ababa". Occurances of such pattern found in different parts of haystack can overlap, so they cannot be only counted in parts, they have to go through sink.
+ pi                 - prefix of pattern from compute_prefix_function
+ pattern_size       - length of pattern
+ */
+static int patternOverlaps(int *pi, unsigned long pattern_size) {
+    return pi[pattern_size - 1] > -1;
+}
+
+/**
+ Function returns true, when pattern with wildcards can overlap with itself. Prefix cannot tell it, because wildcard matches anything, so every shift is tried.
+ pattern            - needle with wildcards
+ wildcards          - positions of wildcards
+ pattern_size       - length of pattern
+ */
+static int wildcardsOverlap(const char *pattern, const unsigned char *wildcards, unsigned long pattern_size) {
+    for (unsigned long shift = 1; shift < pattern_size; shift++) {
+        unsigned long i = 0;
+        while (shift + i < pattern_size && (pattern[i] == pattern[shift + i] || wildcards[i] || wildcards[shift + i])) {
+            i++;
+        }
+        if (shift + i == pattern_size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ Approximate frequency of bytes in text and log files, higher number means more common byte. It is used to pick the rarest bytes of pattern for prefilter.
+ */
+static const unsigned char byteFrequency[256] = {
+      0,   1,   2,   3,   4,   5,   6,   7,   8, 194, 244,   9,  10, 173,  11,  12,
+     13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,
+    255, 163, 206, 169, 166, 167, 168, 192, 200, 199, 177, 170, 230, 225, 232, 217,
+    236, 235, 229, 224, 222, 223, 220, 218, 219, 221, 226, 185, 180, 210, 181, 164,
+    165, 214, 196, 212, 204, 213, 197, 191, 195, 211, 178, 182, 202, 201, 208, 207,
+    203, 175, 209, 216, 215, 193, 189, 190, 176, 179, 174, 188, 161, 187, 160, 205,
+    158, 252, 231, 242, 243, 254, 239, 237, 246, 250, 186, 227, 245, 240, 249, 251,
+    238, 184, 247, 248, 253, 241, 228, 234, 198, 233, 183, 172, 162, 171, 159,  29,
+     94,  95,  96,  97,  98,  99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109,
+    110, 111, 112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125,
+    126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141,
+    142, 143, 144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157,
+     38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51,  52,  53,
+     54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,
+     70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,
+     86,  87,  88,  89,  90,  91,  92,  93,  30,  31,  32,  33,  34,  35,  36,  37,
+};
+
+/**
+ Prefilter in front of KMP loop. It looks for positions, where two rarest bytes of pattern are on their places, and KMP has to look only at them. Most positions of haystack cannot start an occurance, so prefilter skips them 16 or 32 at once with SIMD.
+ */
+typedef struct prefilter {
+    unsigned long offset1;          // position of the rarest byte in pattern
+    unsigned long offset2;          // position of the second rarest byte in pattern
+    unsigned char byte1;
+    unsigned char byte2;
+    unsigned char mask1;            // ORed into byte of haystack before comparison, ASCII_CASE folds letter
+    unsigned char mask2;
+    // returns first candidate position from "from", or limit when there is none
+    unsigned long (*next)(const struct prefilter *filter, const char *text_source, unsigned long from, unsigned long limit);
+} prefilter;
+
+/**
+ Scalar prefilter, which works everywhere. memchr finds the rarest byte and the second one is compared directly. Folded letter cannot be found by memchr, so it is compared byte by byte.
+ */
+static unsigned long prefilterNextScalar(const prefilter *filter, const char *text_source, unsigned long from, unsigned long limit) {
+    const char *position = text_source + from + filter->offset1;
+    const char *end = text_source + limit + filter->offset1;
+    
+    if (filter->mask1) {
+        for (; from < limit; from++) {
+            if (((unsigned char)text_source[from + filter->offset1] | filter->mask1) == filter->byte1
+                && ((unsigned char)text_source[from + filter->offset2] | filter->mask2) == filter->byte2) {
+                return from;
+            }
+        }
+        return limit;
+    }
+    while (position < end && (position = memchr(position, filter->byte1, end - position))) {
+        unsigned long candidate = position - text_source - filter->offset1;
+        if (((unsigned char)text_source[candidate + filter->offset2] | filter->mask2) == filter->byte2) {
+            return candidate;
+        }
+        position++;
+    }
+    return limit;
+}
+
+#ifdef APS_X86
+/**
+ SSE2 prefilter compares 16 positions at once, the rest is left to scalar prefilter.
+ */
+static unsigned long prefilterNextSSE2(const prefilter *filter, const char *text_source, unsigned long from, unsigned long limit) {
+    const __m128i byte1 = _mm_set1_epi8((char)filter->byte1);
+    const __m128i byte2 = _mm_set1_epi8((char)filter->byte2);
+    const __m128i mask1 = _mm_set1_epi8((char)filter->mask1);
+    const __m128i mask2 = _mm_set1_epi8((char)filter->mask2);
+    
+    while (from + 16 <= limit) {
+        __m128i block1 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text_source + from + filter->offset1)), mask1);
+        __m128i block2 = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text_source + from + filter->offset2)), mask2);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block1, byte1), _mm_cmpeq_epi8(block2, byte2)));
+        if (mask) {
+            return from + __builtin_ctz(mask);
+        }
+        from += 16;
+    }
+    return prefilterNextScalar(filter, text_source, from, limit);
+}
+
+/**
+ AVX2 prefilter compares 32 positions at once, the rest is left to SSE2 prefilter.
+ */
+__attribute__((target("avx2")))
+static unsigned long prefilterNextAVX2(const prefilter *filter, const char *text_source, unsigned long from, unsigned long limit) {
+    const __m256i byte1 = _mm256_set1_epi8((char)filter->byte1);
+    const __m256i byte2 = _mm256_set1_epi8((char)filter->byte2);
+    const __m256i mask1 = _mm256_set1_epi8((char)filter->mask1);
+    const __m256i mask2 = _mm256_set1_epi8((char)filter->mask2);
+    
+    while (from + 32 <= limit) {
+        __m256i block1 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text_source + from + filter->offset1)), mask1);
+        __m256i block2 = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text_source + from + filter->offset2)), mask2);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block1, byte1), _mm256_cmpeq_epi8(block2, byte2)));
+        if (mask) {
+            return from + __builtin_ctz(mask);
+        }
+        from += 32;
+    }
+    return prefilterNextSSE2(filter, text_source, from, limit);
+}
+#endif
+
+/**
+ Function prepares prefilter for pattern. It picks two rarest bytes of pattern by byteFrequency and the widest SIMD variant CPU supports.
+ filter             - prefilter we are preparing
+ pattern            - needle that we are trying to find, folded with ignoreCase
+ pattern_size       - length of pattern
+ ignoreCase         - letters of haystack are folded, lower case letter of pattern matches also upper case one
+ */
+static void prefilterInit(prefilter *filter, char *pattern, unsigned long pattern_size, int ignoreCase) {
+    unsigned long rarest = 0;
+    unsigned long second = 0;
+    
+    for (unsigned long i = 1; i < pattern_size; i++) {
+        if (byteFrequency[(unsigned char)pattern[i]] < byteFrequency[(unsigned char)pattern[rarest]]) {
+            rarest = i;
+        }
+    }
+    // second byte should be different from the rarest one, otherwise it filters almost nothing more
+    for (unsigned long i = 0; i < pattern_size; i++) {
+        if (i == rarest) {
+            continue;
+        }
+        int differs = pattern[i] != pattern[rarest];
+        int secondDiffers = second != rarest && pattern[second] != pattern[rarest];
+        if (second == rarest
+            || (differs && !secondDiffers)
+            || (differs == secondDiffers && byteFrequency[(unsigned char)pattern[i]] < byteFrequency[(unsigned char)pattern[second]])) {
+            second = i;
+        }
+    }
+    
+    filter->offset1 = rarest;
+    filter->offset2 = second;
+    filter->byte1 = pattern[rarest];
+    filter->byte2 = pattern[second];
+    // OR with ASCII_CASE turns upper case letter into lower case one and it keeps lower case letter
+    filter->mask1 = ignoreCase && filter->byte1 >= 'a' && filter->byte1 <= 'z' ? ASCII_CASE : 0;
+    filter->mask2 = ignoreCase && filter->byte2 >= 'a' && filter->byte2 <= 'z' ? ASCII_CASE : 0;
+    filter->next = prefilterNextScalar;
+#ifdef APS_X86
+    filter->next = prefilterNextSSE2;
+    if (__builtin_cpu_supports("avx2")) {
+        filter->next = prefilterNextAVX2;
+    }
+#endif
+}
+
+/**
+ Compiled pattern, which is prepared once and then shared by all searches and all workers. It holds tables of every matcher and matcher chosen for this pattern.
+ With more patterns only Aho-Corasick matcher can be used, pattern is then the first of them.
+ Every byte of haystack is compared through table fold, which maps upper case letters to lower case ones with -i and is identity otherwise, patterns are folded already. Positions of wildcards match any byte.
+ */
+typedef struct searchPattern {
+    char *pattern;                  // needle that we are trying to find
+    unsigned long pattern_size;     // length of pattern
+    char **patterns;                // all needles, results are tagged with their index
+    char **givenPatterns;           // needles as they were given, sink prints them out
+    char **foldedPatterns;          // folded copies of needles with -i, patterns point to them
+    unsigned char fold[256];        // byte of haystack as it is compared with patterns
+    unsigned char *wildcards;       // positions of pattern, which match any byte, NULL without wildcards
+    int ignoreCase;
+    int exact;                      // no folding, no wildcards and no errors, so bytes are compared directly
+    unsigned long errors;           // allowed mismatches of approximate matching, 0 for exact matching
+    int edits;                      // errors are also inserted and deleted bytes, not only mismatches
+    unsigned long numberOfPatterns;
+    unsigned long *patternSizes;    // length of every pattern
+    unsigned long maxPatternSize;   // length of the longest pattern, parts of haystack overlap by maxPatternSize - 1
+    int overlaps;                   // some pattern can overlap with itself, see patternOverlaps
+    int *pi;                        // prefix of pattern from compute_prefix_function
+    prefilter filter;               // KMP prefilter of rarest bytes
+    unsigned long skip[256];        // Boyer-Moore-Horspool shifts for last byte of window
+    long critical;                  // Two-Way critical factorization, left part ends at critical
+    unsigned long period;           // Two-Way period of pattern
+    int periodic;                   // Two-Way pattern is periodic, so matching remembers already compared prefix
+    unsigned char byteClass[256];   // Aho-Corasick class of byte, bytes which are not in any pattern share class 0
+    unsigned long numberOfClasses;
+    unsigned long numberOfStates;
+    unsigned int *transitions;      // Aho-Corasick transitions, row of every state has numberOfClasses items, see acPrepare
+    long *statePattern;             // Aho-Corasick first pattern ending in state or -1
+    long *nextPattern;              // next pattern equal to this one or -1
+    unsigned long *dictionaryLink;  // Aho-Corasick nearest state on failure path, where some pattern ends, 0 for none
+    uint64_t masks[256];            // Shift-Or mask of byte of haystack, bit i is 0 when byte matches position i of pattern
+    const struct matcher *matcher;
+    char error[APS_ERROR_SIZE];     // reason, why pattern cannot be compiled, caller prints it out
+} searchPattern;
+
+/**
+ Matcher is one string matching algorithm. Every matcher has to be usable by single threaded and multithreaded search, so it searches one part of haystack at once.
+ search returns number of occurances found. Into buffer it writes all occurances, also overlapping ones, and sink skips the overlapping ones (see resultSink). In count mode buffer only counts them (see bufferInitCount).
+ Occurances starting from starts belong to the next part. Single pattern does not fit into part from there, so only matcher of more patterns has to check it.
+ */
+typedef struct matcher {
+    const char *name;
+    int multiplePatterns;           // matcher can search more patterns at once
+    int wildcards;                  // matcher can search pattern with wildcards
+    int approximate;                // matcher can search with errors
+    // prepares tables of matcher in compiled pattern, returns 0 on success
+    int (*prepare)(searchPattern *compiled);
+    unsigned long (*search)(const searchPattern *compiled, char *text_source, unsigned long text_source_size, unsigned long starts, unsigned long index, resultBuffer *buffer);
+} matcher;
+
+/**
+ Function prepares prefilter for KMP.
+ */
+static int kmpPrepare(searchPattern *compiled) {
+    prefilterInit(&compiled->filter, compiled->pattern, compiled->pattern_size, compiled->ignoreCase);
+    return 0;
+}
+
+/**
+ Knuth-Morris-Pratt loop shared by single threaded and native multithreaded search. Returns number of occurances found.
+ compiled           - compiled pattern with prefix and prefilter
+ text_source        - part of haystack we are searching in
+ text_source_size   - length of text_source
+ starts             - occurances starting from here belong to the next part
+ index              - offset of text_source from beginning of haystack, it is added to every result
+ buffer             - buffer, where we are pushing results
+ */
+static unsigned long kmpSearch(const searchPattern *compiled,
+                        char* text_source,
+                        unsigned long text_source_size,
+                        unsigned long starts,
+                        unsigned long index,
+                        resultBuffer *buffer) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    const unsigned char *fold = compiled->fold;
+    unsigned long pattern_size = compiled->pattern_size;
+    int *pi = compiled->pi;
+    const prefilter *filter = &compiled->filter;
+    unsigned long i;
+    int k = -1;
+    unsigned long counter = 0;
+    // from here occurance does not fit into text_source, so prefilter cannot find anything
+    unsigned long limit = text_source_size >= pattern_size ? text_source_size - pattern_size + 1 : 0;
+    
+    for (i = 0; i < text_source_size; i++) {
+        // when no occurance is started, positions without rare bytes of pattern can be skipped
+        if (k == -1 && i < limit) {
+            i = filter->next(filter, text_source, i, limit);
+            if (i >= text_source_size) {
+                break;
+            }
+        }
+        unsigned char c = fold[(unsigned char)text_source[i]];
+        while (k > -1 && pattern[k+1] != c)
+            k = pi[k];
+        if (c == pattern[k+1])
+            k++;
+        if (k == pattern_size - 1) {
+            counter++;
+            bufferPush(buffer, index + i - k, 0);
+            k = pi[k];
+        }
+    }
+    return counter;
+}
+
+/**
+ Function prepares shifts of Boyer-Moore-Horspool. Shift of byte is its distance from end of pattern, last byte of pattern is not counted. Wildcard matches every byte, so no shift is longer than its distance. Shift of byte of haystack is shift of its folded byte.
+ */
+static int bmhPrepare(searchPattern *compiled) {
+    unsigned long skip[256];
+    
+    for (int c = 0; c < 256; c++) {
+        skip[c] = compiled->pattern_size;
+    }
+    for (unsigned long i = 0; i + 1 < compiled->pattern_size; i++) {
+        if (compiled->wildcards && compiled->wildcards[i]) {
+            for (int c = 0; c < 256; c++) {
+                skip[c] = compiled->pattern_size - 1 - i;
+            }
+        } else {
+            skip[(unsigned char)compiled->pattern[i]] = compiled->pattern_size - 1 - i;
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        compiled->skip[c] = skip[compiled->fold[c]];
+    }
+    return 0;
+}
+
+/**
+ Function compares window of haystack with pattern through folding and wildcards. Returns true, when first size bytes match.
+ */
+static int patternMatches(const searchPattern *compiled, const unsigned char *text, unsigned long size) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    
+    for (unsigned long i = 0; i < size; i++) {
+        if (pattern[i] != compiled->fold[text[i]] && !(compiled->wildcards && compiled->wildcards[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ Boyer-Moore-Horspool loop. Window is compared from its end and then moved by shift of its last byte, so for long patterns most bytes of haystack are never read. Arguments are the same as in kmpSearch.
+ */
+static unsigned long bmhSearch(const searchPattern *compiled,
+                        char* text_source,
+                        unsigned long text_source_size,
+                        unsigned long starts,
+                        unsigned long index,
+                        resultBuffer *buffer) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    const unsigned char *text = (const unsigned char *)text_source;
+    unsigned long pattern_size = compiled->pattern_size;
+    unsigned char last = pattern[pattern_size - 1];
+    int lastWildcard = compiled->wildcards && compiled->wildcards[pattern_size - 1];
+    unsigned long counter = 0;
+    unsigned long j = 0;
+    
+    if (text_source_size < pattern_size) {
+        return 0;
+    }
+    while (j <= text_source_size - pattern_size) {
+        unsigned char c = text[j + pattern_size - 1];
+        if (compiled->exact ? c == last && memcmp(pattern, text + j, pattern_size - 1) == 0
+            : (compiled->fold[c] == last || lastWildcard) && patternMatches(compiled, text + j, pattern_size - 1)) {
+            counter++;
+            bufferPush(buffer, index + j, 0);
+        }
+        j += compiled->skip[c];
+    }
+    return counter;
+}
+
+/**
+ Function returns end of maximal suffix of pattern by byte order (or by reversed order) and sets its period. It is used for critical factorization of Two-Way algorithm.
+ */
+static long maximalSuffix(const unsigned char *pattern, unsigned long pattern_size, int reversed, unsigned long *period) {
+    long suffix = -1;
+    unsigned long j = 0;
+    unsigned long k = 1;
+    unsigned long p = 1;
+    
+    while (j + k < pattern_size) {
+        unsigned char a = pattern[j + k];
+        unsigned char b = pattern[suffix + k];
+        if (reversed ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - suffix;
+        } else if (a == b) {
+            if (k != p) {
+                k++;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            suffix = j;
+            j = suffix + 1;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return suffix;
+}
+
+/**
+ Function prepares critical factorization and period of Two-Way algorithm.
+ */
+static int twoWayPrepare(searchPattern *compiled) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    unsigned long pattern_size = compiled->pattern_size;
+    unsigned long period1, period2;
+    long suffix1 = maximalSuffix(pattern, pattern_size, 0, &period1);
+    long suffix2 = maximalSuffix(pattern, pattern_size, 1, &period2);
+    
+    if (suffix1 > suffix2) {
+        compiled->critical = suffix1;
+        compiled->period = period1;
+    } else {
+        compiled->critical = suffix2;
+        compiled->period = period2;
+    }
+    compiled->periodic = memcmp(pattern, pattern + compiled->period, compiled->critical + 1) == 0;
+    if (!compiled->periodic) {
+        long left = compiled->critical + 1;
+        long right = pattern_size - compiled->critical - 1;
+        compiled->period = (left > right ? left : right) + 1;
+    }
+    return 0;
+}
+
+/**
+ Two-Way loop (Crochemore-Perrin). Right part of pattern is compared from critical factorization forward and left part backward, so it is linear in worst case and needs only constant memory. Arguments are the same as in kmpSearch.
+ */
+static unsigned long twoWaySearch(const searchPattern *compiled,
+                           char* text_source,
+                           unsigned long text_source_size,
+                           unsigned long starts,
+                           unsigned long index,
+                           resultBuffer *buffer) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    const unsigned char *text = (const unsigned char *)text_source;
+    const unsigned char *fold = compiled->fold;
+    long pattern_size = compiled->pattern_size;
+    long critical = compiled->critical;
+    long period = compiled->period;
+    long memory = -1;               // prefix of pattern already known to match, only for periodic pattern
+    unsigned long counter = 0;
+    long i;
+    long j = 0;
+    
+    if (text_source_size < pattern_size) {
+        return 0;
+    }
+    while (j <= (long)text_source_size - pattern_size) {
+        i = (critical > memory ? critical : memory) + 1;
+        while (i < pattern_size && pattern[i] == fold[text[i + j]]) {
+            i++;
+        }
+        if (i < pattern_size) {
+            j += i - critical;
+            memory = -1;
+            continue;
+        }
+        i = critical;
+        while (i > memory && pattern[i] == fold[text[i + j]]) {
+            i--;
+        }
+        if (i <= memory) {
+            counter++;
+            bufferPush(buffer, index + j, 0);
+        }
+        j += period;
+        memory = compiled->periodic ? pattern_size - period - 1 : -1;
+    }
+    return counter;
+}
+
+/**
+ Function builds Aho-Corasick automaton of all patterns. Returns 0 on success.
+ Bytes are first reduced to classes, every byte of patterns has its own class and all other bytes share class 0, so row of state is only as long as number of different bytes in patterns. Automaton is complete (failure links are resolved into transitions), so search reads exactly one transition for every byte of haystack. Transition holds beginning of row of next state, so it does not have to be multiplied, and highest bit (AHO_OUTPUT) tells, that some pattern ends there.
+ */
+static int acPrepare(searchPattern *compiled) {
+    unsigned long classes = 1;
+    unsigned long maxStates = 1;
+    unsigned long states = 1;
+    long *trie;
+    unsigned long *fail;
+    unsigned long *queue;
+    unsigned long head = 0, tail = 0;
+    
+    memset(compiled->byteClass, 0, sizeof(compiled->byteClass));
+    for (unsigned long p = 0; p < compiled->numberOfPatterns; p++) {
+        for (unsigned long i = 0; i < compiled->patternSizes[p]; i++) {
+            unsigned char c = compiled->patterns[p][i];
+            if (!compiled->byteClass[c]) {
+                compiled->byteClass[c] = classes++;
+            }
+        }
+        maxStates += compiled->patternSizes[p];
+    }
+    // folded byte of haystack shares class with its byte in patterns, so search does not fold at all
+    for (int c = 0; c < 256; c++) {
+        compiled->byteClass[c] = compiled->byteClass[compiled->fold[c]];
+    }
+    if (maxStates * classes >= AHO_OUTPUT) {
+        snprintf(compiled->error, sizeof(compiled->error), "Too many patterns!");
+        return -1;
+    }
+    
+    trie = malloc(maxStates * classes * sizeof(long));
+    fail = calloc(maxStates, sizeof(unsigned long));
+    queue = malloc(maxStates * sizeof(unsigned long));
+    compiled->statePattern = malloc(maxStates * sizeof(long));
+    compiled->nextPattern = malloc(compiled->numberOfPatterns * sizeof(long));
+    compiled->dictionaryLink = calloc(maxStates, sizeof(unsigned long));
+    if (!trie || !fail || !queue || !compiled->statePattern || !compiled->nextPattern || !compiled->dictionaryLink) {
+        snprintf(compiled->error, sizeof(compiled->error), "Failed to allocate memory for pattern!");
+        free(trie);
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    for (unsigned long t = 0; t < maxStates * classes; t++) {
+        trie[t] = -1;
+    }
+    for (unsigned long t = 0; t < maxStates; t++) {
+        compiled->statePattern[t] = -1;
+    }
+    
+    // trie of patterns, equal patterns end in the same state and they are chained by nextPattern
+    for (unsigned long p = 0; p < compiled->numberOfPatterns; p++) {
+        unsigned long state = 0;
+        for (unsigned long i = 0; i < compiled->patternSizes[p]; i++) {
+            long *next = &trie[state * classes + compiled->byteClass[(unsigned char)compiled->patterns[p][i]]];
+            if (*next == -1) {
+                *next = states++;
+            }
+            state = *next;
+        }
+        compiled->nextPattern[p] = compiled->statePattern[state];
+        compiled->statePattern[state] = p;
+    }
+    
+    // failure links in breadth first order, failure state is always shallower, so its transitions are complete already
+    for (unsigned long c = 0; c < classes; c++) {
+        if (trie[c] == -1) {
+            trie[c] = 0;
+        } else {
+            queue[tail++] = trie[c];
+        }
+    }
+    while (head < tail) {
+        unsigned long state = queue[head++];
+        for (unsigned long c = 0; c < classes; c++) {
+            long next = trie[state * classes + c];
+            if (next == -1) {
+                trie[state * classes + c] = trie[fail[state] * classes + c];
+                continue;
+            }
+            fail[next] = trie[fail[state] * classes + c];
+            compiled->dictionaryLink[next] = compiled->statePattern[fail[next]] != -1 ? fail[next] : compiled->dictionaryLink[fail[next]];
+            queue[tail++] = next;
+        }
+    }
+    
+    compiled->transitions = malloc(states * classes * sizeof(unsigned int));
+    if (!compiled->transitions) {
+        snprintf(compiled->error, sizeof(compiled->error), "Failed to allocate memory for pattern!");
+        free(trie);
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    for (unsigned long t = 0; t < states * classes; t++) {
+        unsigned long next = trie[t];
+        compiled->transitions[t] = next * classes;
+        if (compiled->statePattern[next] != -1 || compiled->dictionaryLink[next]) {
+            compiled->transitions[t] |= AHO_OUTPUT;
+        }
+    }
+    compiled->numberOfClasses = classes;
+    compiled->numberOfStates = states;
+    
+    free(trie);
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+/**
+ Aho-Corasick loop, which finds all patterns in one pass over haystack. Arguments are the same as in kmpSearch.
+ Patterns have different length, so part is extended by maxPatternSize - 1 and short patterns can be found in extension of part too. Those belong to the next part and they are skipped by starts.
+ */
+static unsigned long acSearch(const searchPattern *compiled,
+                       char* text_source,
+                       unsigned long text_source_size,
+                       unsigned long starts,
+                       unsigned long index,
+                       resultBuffer *buffer) {
+    const unsigned char *text = (const unsigned char *)text_source;
+    const unsigned int *transitions = compiled->transitions;
+    const unsigned char *byteClass = compiled->byteClass;
+    unsigned long counter = 0;
+    unsigned int row = 0;
+    
+    for (unsigned long i = 0; i < text_source_size; i++) {
+        unsigned int next = transitions[row + byteClass[text[i]]];
+        row = next & ~AHO_OUTPUT;
+        if (!(next & AHO_OUTPUT)) {
+            continue;
+        }
+        unsigned long state = row / compiled->numberOfClasses;
+        if (compiled->statePattern[state] == -1) {
+            state = compiled->dictionaryLink[state];
+        }
+        // every pattern, which is suffix of text read so far
+        while (state) {
+            for (long p = compiled->statePattern[state]; p != -1; p = compiled->nextPattern[p]) {
+                unsigned long start = i + 1 - compiled->patternSizes[p];
+                if (start < starts) {
+                    counter++;
+                    bufferPush(buffer, index + start, p);
+                }
+            }
+            state = compiled->dictionaryLink[state];
+        }
+    }
+    return counter;
+}
+
+/**
+ Function prepares masks of Shift-Or for every byte of haystack through folding and wildcards. Pattern has to fit into one machine word. Returns 0 on success.
+ */
+static int shiftOrPrepare(searchPattern *compiled) {
+    const unsigned char *pattern = (const unsigned char *)compiled->pattern;
+    
+    if (compiled->pattern_size > SHIFT_OR_MAX_PATTERN) {
+        snprintf(compiled->error, sizeof(compiled->error), "Algorithm shiftor searches pattern of at most %d bytes!", SHIFT_OR_MAX_PATTERN);
+        return -1;
+    }
+    for (int c = 0; c < 256; c++) {
+        uint64_t mask = ~0ull;
+        for (unsigned long i = 0; i < compiled->pattern_size; i++) {
+            if (pattern[i] == compiled->fold[c] || (compiled->wildcards && compiled->wildcards[i])) {
+                mask &= ~(1ull << i);
+            }
+        }
+        compiled->masks[c] = mask;
+    }
+    return 0;
+}
+
+/**
+ Bit-parallel Shift-Or loop (Wu-Manber bitap). State of every number of errors j is one machine word, its bit i is 0 when first i + 1 bytes of pattern end on current byte with at most j errors. Without edits errors are only mismatched bytes, with edits also bytes inserted into haystack or deleted from it. So every byte of haystack costs a few word operations for every allowed error, however many of them are. Arguments are the same as in kmpSearch.
+ Occurance is reported at end of it minus length of pattern, with edits it can be up to errors bytes longer, so parts overlap by maxPatternSize - 1, which counts errors too. Occurances are owned by part, where whole their longest possible text is: the first part takes all of them and every other part only ones, which end at least maxPatternSize - 1 bytes after its beginning, earlier ones are in extension of previous part.
+ */
+static unsigned long shiftOrSearch(const searchPattern *compiled,
+                            char* text_source,
+                            unsigned long text_source_size,
+                            unsigned long starts,
+                            unsigned long index,
+                            resultBuffer *buffer) {
+    const unsigned char *text = (const unsigned char *)text_source;
+    const uint64_t *masks = compiled->masks;
+    unsigned long pattern_size = compiled->pattern_size;
+    unsigned long errors = compiled->errors;
+    unsigned long span = compiled->maxPatternSize;
+    uint64_t found = 1ull << (pattern_size - 1);
+    uint64_t state[SHIFT_OR_MAX_PATTERN];
+    unsigned long counter = 0;
+    // ends before first end are not whole in this part, at the beginning of haystack all of them are
+    unsigned long first = index ? span - 1 : 0;
+    unsigned long end = starts + span - 1 < text_source_size ? starts + span - 1 : text_source_size;
+    
+    if (errors == 0) {
+        uint64_t d = ~0ull;
+        for (unsigned long i = 0; i < end; i++) {
+            d = (d << 1) | masks[text[i]];
+            if (!(d & found) && i >= first) {
+                counter++;
+                bufferPush(buffer, index + i + 1 - pattern_size, 0);
+            }
+        }
+        return counter;
+    }
+    
+    // with edits first j bytes of pattern can be deleted before any byte of haystack
+    for (unsigned long j = 0; j <= errors; j++) {
+        state[j] = compiled->edits ? ~0ull << j : ~0ull;
+    }
+    for (unsigned long i = 0; i < end; i++) {
+        uint64_t mask = masks[text[i]];
+        uint64_t previous = state[0];
+        state[0] = (state[0] << 1) | mask;
+        for (unsigned long j = 1; j <= errors; j++) {
+            uint64_t current = state[j];
+            if (compiled->edits) {
+                // match, mismatch, deleted byte of pattern, inserted byte of haystack
+                state[j] = ((current << 1) | mask) & (previous << 1) & (state[j - 1] << 1) & previous;
+            } else {
+                state[j] = ((current << 1) | mask) & (previous << 1);
+            }
+            previous = current;
+        }
+        if (!(state[errors] & found) && i >= first) {
+            counter++;
+            // with deleted bytes occurance can end before length of pattern
+            bufferPush(buffer, index + i + 1 >= pattern_size ? index + i + 1 - pattern_size : 0, 0);
+        }
+    }
+    return counter;
+}
+
+static const matcher matchers[] = {
+    {"kmp", 0, 0, 0, kmpPrepare, kmpSearch},
+    {"bmh", 0, 1, 0, bmhPrepare, bmhSearch},
+    {"twoway", 0, 0, 0, twoWayPrepare, twoWaySearch},
+    {"ahocorasick", 1, 0, 0, acPrepare, acSearch},
+    {"shiftor", 0, 1, 1, shiftOrPrepare, shiftOrSearch},
+};
+
+/**
+ Function returns matcher by its name or NULL, when there is no such matcher.
+ */
+static const matcher *findMatcher(const char *name) {
+    for (unsigned long m = 0; m < sizeof(matchers) / sizeof(matchers[0]); m++) {
+        if (!strcmp(matchers[m].name, name)) {
+            return &matchers[m];
+        }
+    }
+    return NULL;
+}
+
+/**
+ Function picks matcher for pattern by its length and bytes.
+ When pattern has at least one byte, which is not very common, KMP prefilter skips most of haystack with SIMD, so KMP is used for it and for short patterns. Long patterns made only of the most common bytes would give prefilter too many candidates, they use Boyer-Moore-Horspool, which shifts by almost whole pattern. Periodic patterns like "abababab" make Boyer-Moore-Horspool quadratic, so they use Two-Way, which stays linear. More patterns are always searched by Aho-Corasick. Pattern with wildcards is searched by Boyer-Moore-Horspool. Approximate matching can be done only by Shift-Or.
+ */
+static const matcher *selectMatcher(searchPattern *compiled) {
+    unsigned long pattern_size = compiled->pattern_size;
+    unsigned char rarest = 255;
+    
+    if (compiled->errors) {
+        return findMatcher("shiftor");
+    }
+    if (compiled->numberOfPatterns > 1) {
+        return findMatcher("ahocorasick");
+    }
+    if (compiled->wildcards) {
+        return findMatcher("bmh");
+    }
+    // shortest period of pattern
+    unsigned long period = pattern_size - 1 - compiled->pi[pattern_size - 1];
+    
+    for (unsigned long i = 0; i < pattern_size; i++) {
+        if (byteFrequency[(unsigned char)compiled->pattern[i]] < rarest) {
+            rarest = byteFrequency[(unsigned char)compiled->pattern[i]];
+        }
+    }
+    
+    if (pattern_size < MIN_SKIP_PATTERN_SIZE || rarest < COMMON_BYTE_FREQUENCY) {
+        return findMatcher("kmp");
+    }
+    if (period * MIN_PERIODIC_REPEATS <= pattern_size) {
+        return findMatcher("twoway");
+    }
+    return findMatcher("bmh");
+}
+
+/**
+ Function releases compiled pattern.
+ */
+static void searchPatternFree(searchPattern *compiled) {
+    if (compiled->foldedPatterns) {
+        for (unsigned long p = 0; p < compiled->numberOfPatterns; p++) {
+            free(compiled->foldedPatterns[p]);
+        }
+        free(compiled->foldedPatterns);
+    }
+    free(compiled->wildcards);
+    free(compiled->pi);
+    free(compiled->patternSizes);
+    free(compiled->transitions);
+    free(compiled->statePattern);
+    free(compiled->nextPattern);
+    free(compiled->dictionaryLink);
+    memset(compiled, 0, sizeof(searchPattern));
+}
+
+/**
+ Function releases compiled pattern, which cannot be compiled, and keeps reason in it, so caller can print it out. Returns -1.
+ */
+static int searchPatternFail(searchPattern *compiled, const char *format, ...) {
+    char error[APS_ERROR_SIZE];
+    va_list arguments;
+    
+    va_start(arguments, format);
+    vsnprintf(error, sizeof(error), format, arguments);
+    va_end(arguments);
+    searchPatternFree(compiled);
+    memcpy(compiled->error, error, sizeof(error));
+    return -1;
+}
+
+/**
+ Function compiles patterns for searching. Returns 0 on success, otherwise reason is in error of compiled pattern.
+ compiled           - compiled pattern we are preparing
+ patterns           - needles that we are trying to find, they have to live as long as compiled pattern
+ numberOfPatterns   - length of patterns
+ algorithm          - name of matcher or NULL to select it automatically
+ options            - PATTERN_IGNORE_CASE folds ASCII letters, PATTERN_WILDCARDS makes ? match any byte, PATTERN_EDITS makes errors also inserted and deleted bytes
+ errors             - allowed mismatched bytes of approximate matching (or edits with PATTERN_EDITS), 0 for exact matching
+ */
+static int searchPatternInit(searchPattern *compiled, char **patterns, unsigned long numberOfPatterns, const char *algorithm, int options, unsigned long errors) {
+    memset(compiled, 0, sizeof(searchPattern));
+    compiled->patterns = patterns;
+    compiled->givenPatterns = patterns;
+    compiled->numberOfPatterns = numberOfPatterns;
+    compiled->patternSizes = malloc(numberOfPatterns * sizeof(unsigned long));
+    if (!compiled->patternSizes) {
+        return searchPatternFail(compiled, "Failed to allocate memory for pattern!");
+    }
+    for (int c = 0; c < 256; c++) {
+        compiled->fold[c] = c;
+    }
+    if (options & PATTERN_IGNORE_CASE) {
+        compiled->ignoreCase = 1;
+        for (int c = 'A'; c <= 'Z'; c++) {
+            compiled->fold[c] = c | ASCII_CASE;
+        }
+        compiled->foldedPatterns = calloc(numberOfPatterns, sizeof(char *));
+        if (!compiled->foldedPatterns) {
+            return searchPatternFail(compiled, "Failed to allocate memory for pattern!");
+        }
+        for (unsigned long p = 0; p < numberOfPatterns; p++) {
+            size_t size = strlen(patterns[p]);
+            if (!(compiled->foldedPatterns[p] = malloc(size + 1))) {
+                return searchPatternFail(compiled, "Failed to allocate memory for pattern!");
+            }
+            for (size_t i = 0; i <= size; i++) {
+                compiled->foldedPatterns[p][i] = compiled->fold[(unsigned char)patterns[p][i]];
+            }
+        }
+        compiled->patterns = compiled->foldedPatterns;
+    }
+    int wildcards = 0;
+    for (unsigned long p = 0; p < numberOfPatterns && (options & PATTERN_WILDCARDS); p++) {
+        wildcards |= strchr(patterns[p], WILDCARD) != NULL;
+    }
+    if (wildcards) {
+        size_t size = strlen(patterns[0]);
+        if (numberOfPatterns > 1) {
+            return searchPatternFail(compiled, "Wildcards can be used only with one pattern!");
+        }
+        if (!(compiled->wildcards = malloc(size))) {
+            return searchPatternFail(compiled, "Failed to allocate memory for pattern!");
+        }
+        for (size_t i = 0; i < size; i++) {
+            compiled->wildcards[i] = patterns[0][i] == WILDCARD;
+        }
+    }
+    if (errors && numberOfPatterns > 1) {
+        return searchPatternFail(compiled, "Errors can be allowed only with one pattern!");
+    }
+    compiled->errors = errors;
+    compiled->edits = errors && (options & PATTERN_EDITS);
+    compiled->exact = !compiled->ignoreCase && !compiled->wildcards && !compiled->errors;
+    for (unsigned long p = 0; p < numberOfPatterns; p++) {
+        compiled->patternSizes[p] = strlen(patterns[p]);
+        if (compiled->patternSizes[p] == 0) {
+            return searchPatternFail(compiled, "Pattern is empty!");
+        }
+        if (compiled->patternSizes[p] > compiled->maxPatternSize) {
+            compiled->maxPatternSize = compiled->patternSizes[p];
+        }
+        int *pi = compute_prefix_function(compiled->patterns[p], compiled->patternSizes[p]);
+        if (!pi) {
+            return searchPatternFail(compiled, "Failed to allocate memory for pattern!");
+        }
+        compiled->overlaps |= compiled->wildcards ? wildcardsOverlap(compiled->patterns[p], compiled->wildcards, compiled->patternSizes[p]) : patternOverlaps(pi, compiled->patternSizes[p]);
+        if (p == 0) {
+            compiled->pi = pi;
+        } else {
+            free(pi);
+        }
+    }
+    compiled->pattern = compiled->patterns[0];
+    compiled->pattern_size = compiled->patternSizes[0];
+    if (errors >= compiled->pattern_size) {
+        return searchPatternFail(compiled, "Pattern has to be longer than number of errors!");
+    }
+    if (errors) {
+        // approximate occurances near each other are the same typo, sink keeps only the first of them like overlapping ones
+        compiled->overlaps = 1;
+    }
+    if (compiled->edits) {
+        // with inserted bytes occurance is longer than pattern
+        compiled->maxPatternSize += errors;
+    }
+    
+    if (algorithm && strcmp(algorithm, "auto")) {
+        compiled->matcher = findMatcher(algorithm);
+        if (!compiled->matcher) {
+            return searchPatternFail(compiled, "Unknown algorithm %s!", algorithm);
+        }
+        if (numberOfPatterns > 1 && !compiled->matcher->multiplePatterns) {
+            return searchPatternFail(compiled, "Algorithm %s searches only one pattern!", algorithm);
+        }
+        if (compiled->wildcards && !compiled->matcher->wildcards) {
+            return searchPatternFail(compiled, "Algorithm %s cannot search wildcards!", algorithm);
+        }
+        if (compiled->errors && !compiled->matcher->approximate) {
+            return searchPatternFail(compiled, "Algorithm %s cannot search with errors!", algorithm);
+        }
+    } else {
+        compiled->matcher = selectMatcher(compiled);
+    }
+    if (compiled->matcher->prepare(compiled)) {
+        return searchPatternFail(compiled, "%s", compiled->error);
+    }
+    return 0;
+}
+
+/**
+ Function returns true, when searches only count occurances into sink and never write them (see bufferInitCount). Counts are not ordered, so with limit of sink it is possible only for one pattern, with more patterns it is not known, which occurances are the first ones.
+ */
+static int sinkCountOnly(const resultSink *sink, const searchPattern *compiled) {
+    return sink->countOption && !compiled->overlaps && (!sink->maxFinds || compiled->numberOfPatterns == 1);
+}
+
+/**
+ Function runs matcher of compiled pattern over one part of haystack and with -d adds part to work of worker. Time of matcher includes writing of full buffers into sink. Arguments are the same as of search of matcher. Returns number of occurances found.
+ */
+static unsigned long searchPart(const searchPattern *compiled, char *text_source, unsigned long text_source_size, unsigned long starts, unsigned long index, resultBuffer *buffer, profileWorker *worker) {
+    unsigned long long begin = profileNow();
+    unsigned long found = compiled->matcher->search(compiled, text_source, text_source_size, starts, index, buffer);
+    
+    if (profile.enabled) {
+        unsigned long long busy = profileNow() - begin;
+        worker->bytes += starts < text_source_size ? starts : text_source_size;
+        worker->matches += found;
+        worker->parts++;
+        worker->busy += busy;
+        __sync_fetch_and_add(&profile.phases[PROFILE_SEARCH], busy);
+    }
+    return found;
+}
+
+/**
+ Function searches haystack in one thread with buffer of caller, part after part. With limit of sink or with callback haystack is searched in parts of STOP_PART_SIZE, so search stops soon after the last wanted occurance. Buffer with counts (see bufferInitCount) only counts occurances.
+ text_source        - haystack array of characters.
+ text_source_size   - text_source length
+ compiled           - compiled pattern from searchPatternInit
+ sink               - sink, where we are writing results
+ buffer             - buffer of results, it is not released
+ worker             - work of this thread for -d
+ */
+static void findStringParts(char* text_source,
+                     unsigned long text_source_size,
+                     const searchPattern *compiled,
+                     resultSink *sink,
+                     resultBuffer *buffer,
+                     profileWorker *worker) {
+    int countOnly = buffer->counts != NULL;
+    unsigned long partSize = (sink->maxFinds || sink->callback) && text_source_size > STOP_PART_SIZE ? STOP_PART_SIZE : text_source_size;
+    
+    for (unsigned long part = 0; part * partSize < text_source_size && !sink->cancelled; part++) {
+        unsigned long index = part * partSize;
+        unsigned long size = partSize + compiled->maxPatternSize - 1;
+        
+        if (index + size > text_source_size) {
+            size = text_source_size - index;
+        }
+        if (countOnly) {
+            searchPart(compiled, text_source + index, size, partSize, index, buffer, worker);
+            bufferFlushCount(buffer);
+            continue;
+        }
+        bufferInit(buffer, sink, part);
+        searchPart(compiled, text_source + index, size, partSize, index, buffer, worker);
+        bufferFinish(buffer);
+    }
+}
+
+#ifndef APS_LIBRARY
+/**
+ Function for searching string in string using matcher of compiled pattern. Writes all occurances and their offset from beginning into sink.
+ text_source        - haystack array of characters.
+ text_source_size   - text_source length
+ compiled           - compiled pattern from searchPatternInit
+ sink               - sink, where we are writing results
+ */
+static void findStringSingleThread(char* text_source,
+                   unsigned long text_source_size,
+                   const searchPattern *compiled,
+                   resultSink *sink) {
+    resultBuffer *buffer;
+    int countOnly = sinkCountOnly(sink, compiled);
+    profileWorker worker = {"host", 0, 0, 0, 0};
+    
+    buffer = malloc(sizeof(resultBuffer));
+    if (!buffer) {
+        return;
+    }
+    bufferInit(buffer, sink, 0);
+    if (countOnly && bufferInitCount(buffer, sink)) {
+        free(buffer);
+        return;
+    }
+    findStringParts(text_source, text_source_size, compiled, sink, buffer, &worker);
+    if (countOnly) {
+        bufferFinishCount(buffer);
+    }
+    profileWorkerDone(&worker);
+
+    free(buffer);
+    return;
+    
+
+}
+#endif
+
+/**
+ Compiled patterns of library. Patterns are copied, so caller can release its own.
+ */
+struct apsPattern {
+    searchPattern compiled;
+    char **patterns;                // copies of needles, compiled pattern points to them
+    unsigned long numberOfPatterns;
+};
+
+/**
+ Scratch of library search. Its sink prints nothing, it only skips overlapping occurances and calls callback, and it is prepared once, so search only resets it.
+ */
+struct apsScratch {
+    resultSink sink;
+    resultBuffer buffer;
+    unsigned long *counts;          // counts of buffer, when occurances are only counted (see sinkCountOnly)
+};
+
+/**
+ Function compiles patterns for library, see aps.h.
+ */
+apsPattern *apsPatternCompile(const char **patterns, unsigned long numberOfPatterns, const char *algorithm, int options, unsigned long errors, char *error) {
+    apsPattern *pattern;
+    
+    if (!numberOfPatterns) {
+        if (error) {
+            snprintf(error, APS_ERROR_SIZE, "Pattern is empty!");
+        }
+        return NULL;
+    }
+    pattern = calloc(1, sizeof(apsPattern));
+    if (!pattern || !(pattern->patterns = calloc(numberOfPatterns, sizeof(char *)))) {
+        if (error) {
+            snprintf(error, APS_ERROR_SIZE, "Failed to allocate memory for pattern!");
+        }
+        free(pattern);
+        return NULL;
+    }
+    pattern->numberOfPatterns = numberOfPatterns;
+    for (unsigned long p = 0; p < numberOfPatterns; p++) {
+        if (!(pattern->patterns[p] = strdup(patterns[p]))) {
+            if (error) {
+                snprintf(error, APS_ERROR_SIZE, "Failed to allocate memory for pattern!");
+            }
+            apsPatternFree(pattern);
+            return NULL;
+        }
+    }
+    if (searchPatternInit(&pattern->compiled, pattern->patterns, numberOfPatterns, algorithm, options, errors)) {
+        if (error) {
+            memcpy(error, pattern->compiled.error, APS_ERROR_SIZE);
+        }
+        apsPatternFree(pattern);
+        return NULL;
+    }
+    return pattern;
+}
+
+/**
+ Function releases compiled patterns of library.
+ */
+void apsPatternFree(apsPattern *pattern) {
+    if (!pattern) {
+        return;
+    }
+    searchPatternFree(&pattern->compiled);
+    for (unsigned long p = 0; p < pattern->numberOfPatterns; p++) {
+        free(pattern->patterns[p]);
+    }
+    free(pattern->patterns);
+    free(pattern);
+}
+
+/**
+ Function returns name of matcher of compiled patterns.
+ */
+const char *apsPatternAlgorithm(const apsPattern *pattern) {
+    return pattern->compiled.matcher->name;
+}
+
+/**
+ Function prepares scratch of one thread for searches of compiled patterns.
+ */
+apsScratch *apsScratchNew(const apsPattern *pattern) {
+    apsScratch *scratch = malloc(sizeof(apsScratch));
+    
+    if (!scratch) {
+        return NULL;
+    }
+    if (!(scratch->counts = calloc(pattern->numberOfPatterns, sizeof(unsigned long)))) {
+        free(scratch);
+        return NULL;
+    }
+    // lengths of folded patterns are the same as of given ones
+    if (sinkInit(&scratch->sink, NULL, 0, pattern->compiled.patterns, pattern->numberOfPatterns, 0, 0, 0, 1)) {
+        free(scratch->counts);
+        free(scratch);
+        return NULL;
+    }
+    bufferInit(&scratch->buffer, &scratch->sink, 0);
+    return scratch;
+}
+
+/**
+ Function releases scratch.
+ */
+void apsScratchFree(apsScratch *scratch) {
+    if (!scratch) {
+        return;
+    }
+    sinkFree(&scratch->sink);
+    free(scratch->counts);
+    free(scratch);
+}
+
+/**
+ Function searches buffer of caller with scratch of this thread, see aps.h. Sink of scratch is only reset, so nothing is allocated.
+ */
+unsigned long apsSearch(const apsPattern *pattern, apsScratch *scratch, const char *text, unsigned long size, apsCallback callback, void *context) {
+    resultSink *sink = &scratch->sink;
+    profileWorker worker = {"library", 0, 0, 0, 0};
+    
+    memset(sink->patternFinds, 0, sink->numberOfPatterns * sizeof(unsigned long));
+    memset(sink->nextStart, 0, sink->numberOfPatterns * sizeof(unsigned long));
+    sink->numberOfFinds = 0;
+    sink->cancelled = 0;
+    sink->currentPart = 0;
+    sink->text_source = (char *)text;
+    sink->text_source_size = size;
+    sink->callback = callback;
+    sink->context = context;
+    // without callback occurances, which cannot overlap, are only counted in parts
+    sink->countOption = !callback;
+    bufferInit(&scratch->buffer, sink, 0);
+    if (sinkCountOnly(sink, &pattern->compiled)) {
+        scratch->buffer.counts = scratch->counts;
+    }
+    findStringParts((char *)text, size, &pattern->compiled, sink, &scratch->buffer, &worker);
+    return sink->numberOfFinds;
+}
+
+#ifndef APS_LIBRARY
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+/**
+ Strategy of loading files chosen by -I. Mapped file is searched with hints for kernel: sequential reads ahead more, huge adds transparent huge pages, so there are less faults, and populate fills page tables of every part at once, before it is searched, and reads next part ahead. Read and direct do not map file, it is read like stream into aligned buffers ahead of search, direct with O_DIRECT past page cache.
+ */
+static int ioStrategy = IO_MMAP;
+static const char *ioStrategies[IO_STRATEGIES] = {"mmap", "sequential", "huge", "populate", "read", "direct"};
+
+/**
+ Function returns strategy by its name or -1, when there is no such strategy.
+ */
+static int ioStrategyFind(const char *name) {
+    for (int s = 0; s < IO_STRATEGIES; s++) {
+        if (!strcmp(ioStrategies[s], name)) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+/**
+ Function maps whole file for reading with hints of strategy. Read strategies map file like sequential one, for example files of multi-file search. Returns MAP_FAILED on error.
+ */
+static char *ioMap(int fd, unsigned long size) {
+    char *text = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    
+    if (text == MAP_FAILED || ioStrategy == IO_MMAP || ioStrategy == IO_POPULATE) {
+        return text;
+    }
+    madvise(text, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (ioStrategy == IO_HUGE) {
+        madvise(text, size, MADV_HUGEPAGE);
+    }
+#endif
+    return text;
+}
+
+/**
+ Function prepares part of mapped haystack for populate strategy, other strategies leave it to faults. Part is populated by one call instead of fault after fault of 4 KB pages, and part, which is searched after it, is read ahead, while this one is searched. Older kernels without MADV_POPULATE_READ only read part ahead.
+ text_source        - mapped haystack
+ text_source_size   - length of text_source
+ index              - offset of part
+ size               - length of part with overlap
+ ahead              - offset of part, which is read ahead
+ */
+static void ioPreparePart(char *text_source, unsigned long text_source_size, unsigned long index, unsigned long size, unsigned long ahead) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    
+    if (ioStrategy != IO_POPULATE) {
+        return;
+    }
+    unsigned long start = index / page * page;
+    if (madvise(text_source + start, index + size - start, MADV_POPULATE_READ) && errno == EINVAL) {
+        madvise(text_source + start, index + size - start, MADV_WILLNEED);
+    }
+    if (ahead < text_source_size) {
+        start = ahead / page * page;
+        madvise(text_source + start, (ahead + size < text_source_size ? ahead + size : text_source_size) - start, MADV_WILLNEED);
+    }
+}
+
+/**
+ Everything workers of native multithreaded search share. Haystack is split into parts, which workers take in order one after another. Haystack can be also block of stream, then offsets and parts of sink continue from previous blocks.
+ */
+typedef struct {
+    char *text_source;
+    unsigned long text_source_size;
+    unsigned long textOffset;       // offset of text_source in stream, 0 for file
+    const searchPattern *compiled;
+    unsigned long partSize;         // length of part without overlap of maxPatternSize - 1
+    unsigned long numberOfParts;
+    unsigned long firstPart;        // part of sink, which the first part of haystack is
+    unsigned long nextPart;         // next part, which is not taken by any worker
+    unsigned long numberOfWorkers;  // with populate strategy worker reads ahead part, which it takes after all other workers
+    int mapped;                     // haystack is mapped file, so populate strategy prepares its parts
+    int countOnly;                  // workers only count occurances, see sinkCountOnly
+    profileWorker *workers;         // work of every worker added over all blocks of stream, NULL when workers report their work themselves
+    unsigned long nextWorker;       // next item of workers
+    resultSink *sink;
+} searchJob;
+
+/**
+ Thread function of native multithreaded search. Takes parts of haystack in order and runs matcher over them. Every worker has its own bounded buffer, so workers never share memory they write to.
+ */
+static void *searchWorkerRun(void *arg) {
+    searchJob *job = (searchJob *)arg;
+    const searchPattern *compiled = job->compiled;
+    resultBuffer *buffer;
+    unsigned long part;
+    profileWorker worker = {"host", 0, 0, 0, 0};
+    profileWorker *work = job->workers ? &job->workers[__sync_fetch_and_add(&job->nextWorker, 1)] : &worker;
+    int countOnly = job->countOnly;
+    
+    if (!(buffer = malloc(sizeof(resultBuffer))) || (countOnly && bufferInitCount(buffer, job->sink))) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    
+    // parts are taken in order, so parts before the last wanted occurance are always searched whole
+    while (!job->sink->cancelled && (part = __sync_fetch_and_add(&job->nextPart, 1)) < job->numberOfParts) {
+        unsigned long index = part * job->partSize;
+        unsigned long partSize = job->partSize + compiled->maxPatternSize - 1;
+        
+        if (index + partSize > job->text_source_size) {
+            partSize = job->text_source_size - index;
+        }
+        if (job->mapped) {
+            ioPreparePart(job->text_source, job->text_source_size, index, partSize, index + job->numberOfWorkers * job->partSize);
+        }
+        if (countOnly) {
+            // count mode keeps only counts, which are added to sink after every part
+            searchPart(compiled, job->text_source + index, partSize, job->partSize, job->textOffset + index, buffer, work);
+            bufferFlushCount(buffer);
+            continue;
+        }
+        bufferInit(buffer, job->sink, job->firstPart + part);
+        searchPart(compiled, job->text_source + index, partSize, job->partSize, job->textOffset + index, buffer, work);
+        bufferFinish(buffer);
+    }
+    
+    if (countOnly) {
+        bufferFinishCount(buffer);
+    }
+    if (!job->workers) {
+        profileWorkerDone(&worker);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ Function splits haystack of job into parts and searches them with native workers. Caller fills haystack, compiled pattern, sink and fields of stream. Returns number of workers used.
+ job                - job with haystack
+ numOfWorkers       - requested number of workers, 0 means number of online processors
+ */
+static size_t searchJobRun(searchJob *job, size_t numOfWorkers) {
+    unsigned long text_source_size = job->text_source_size;
+    unsigned long pattern_size = job->compiled->maxPatternSize;
+    resultSink *sink = job->sink;
+    
+    job->nextPart = 0;
+    job->nextWorker = 0;
+    if (numOfWorkers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numOfWorkers = online > 0 ? online : 1;
+    }
+    
+    // Parts shorter than few patterns are not worth of thread
+    if (text_source_size / (pattern_size * MIN_PART_SIZE_FACTOR) < numOfWorkers) {
+        numOfWorkers = text_source_size / (pattern_size * MIN_PART_SIZE_FACTOR);
+    }
+    if (numOfWorkers == 0) {
+        numOfWorkers = 1;
+    }
+    
+    // Smaller parts keep workers waiting for each other in sink shorter, with limit they stop sooner after the last wanted occurance
+    job->partSize = text_source_size / numOfWorkers;
+    if (job->partSize > (sink->maxFinds ? STOP_PART_SIZE : MAX_PART_SIZE)) {
+        job->partSize = sink->maxFinds ? STOP_PART_SIZE : MAX_PART_SIZE;
+    }
+    if (job->partSize == 0) {
+        job->partSize = 1;
+    }
+    job->numberOfParts = (text_source_size + job->partSize - 1) / job->partSize;
+    job->numberOfWorkers = numOfWorkers;
+    
+    pthread_t *threads = malloc(numOfWorkers * sizeof(pthread_t));
+    if (!threads) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        if (pthread_create(&threads[w], NULL, searchWorkerRun, job) != 0) {
+            printf("Error: Failed to create worker thread!\n");
+            exit(1);
+        }
+    }
+    
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    
+    free(threads);
+    return numOfWorkers;
+}
+
+/**
+ Function for searching string in string using matcher of compiled pattern with native threads (pthreads), so it does not need any OpenCL device. Haystack is split into parts the same way as in run kernel, every part is extended by maxPatternSize - 1 characters, so no occurance on border of parts is lost. There are more parts than workers, workers take them in order and results are written into sink in order of parts. Returns number of workers used.
+ text_source        - haystack array of characters
+ text_source_size   - length of text_source
+ compiled           - compiled pattern from searchPatternInit
+ sink               - sink, where we are writing results
+ numOfWorkers       - requested number of workers, 0 means number of online processors
+ */
+static size_t findStringNativeThreads(char* text_source,
+                               unsigned long text_source_size,
+                               const searchPattern *compiled,
+                               resultSink *sink,
+                               size_t numOfWorkers) {
+    searchJob job;
+    
+    memset(&job, 0, sizeof(searchJob));
+    job.text_source = text_source;
+    job.text_source_size = text_source_size;
+    job.compiled = compiled;
+    job.sink = sink;
+    job.mapped = 1;
+    job.countOnly = sinkCountOnly(sink, compiled);
+    return searchJobRun(&job, numOfWorkers);
+}
+
+
+/**
+ One file of multi-file search. File is mapped, when the first of its parts is taken, and unmapped, when the last one is finished, so only files which are being searched are open.
+ */
+typedef struct {
+    char *name;
+    unsigned long size;
+    unsigned long partSize;         // length of part without overlap of maxPatternSize - 1
+    unsigned long numberOfParts;
+    unsigned long partsDone;
+    char *text_source;              // mapped file, NULL before its first part
+    int failed;                     // file cannot be opened, its parts are skipped
+    pthread_mutex_t lock;
+    resultSink sink;                // every file has own sink, so its results stay ordered
+} searchFile;
+
+/**
+ List of files, which are searched.
+ */
+typedef struct {
+    searchFile *files;
+    unsigned long numberOfFiles;
+    unsigned long capacity;
+    unsigned long size;             // length of all files
+} fileList;
+
+/**
+ One task of multi-file search. It is either one part of big file or batch of small files.
+ */
+typedef struct {
+    unsigned long file;             // index of first file in fileList
+    unsigned long numberOfFiles;    // more than one only for batch of small files
+    unsigned long part;
+} fileTask;
+
+/**
+ Queue of tasks of one worker. All tasks are known before workers start, so queue is only read from head. When worker's own queue is empty, it steals from head of other queues. Owner takes from head too, so parts of one file are always taken in order and worker waiting in bufferDrain for previous part of file waits only for worker, which is already searching it.
+ */
+typedef struct {
+    fileTask *tasks;
+    unsigned long head;
+    unsigned long tail;
+    pthread_mutex_t lock;
+} taskQueue;
+
+/**
+ Everything workers of multi-file search share.
+ */
+typedef struct {
+    fileList *list;
+    const searchPattern *compiled;
+    taskQueue *queues;              // one for every worker
+    size_t numberOfQueues;
+    int linesOption;
+    int offsetOption;
+    int countOption;
+    unsigned long before;           // lines of context, see sinkSetContext
+    unsigned long after;
+    unsigned long maxFinds;         // limit of every file, see sinkSetLimit
+    int quiet;                      // search stops after the first file with occurance
+    volatile int cancelled;         // quiet search found occurance, parts are not searched anymore
+    unsigned long numberOfFinds;    // of all files
+} fileScheduler;
+
+/**
+ Argument of thread function of multi-file search.
+ */
+typedef struct {
+    fileScheduler *scheduler;
+    size_t id;                      // index of own queue
+} fileWorker;
+
+/**
+ Function adds file or all regular files in directory and its subdirectories to list of files. Empty files are skipped. Returns 0 on success.
+ list               - list of files
+ path               - path to file or directory
+ followLinks        - symbolic link is followed, it is true only for paths from command line, so links cannot make a cycle
+ */
+static int fileListAdd(fileList *list, const char *path, int followLinks) {
+    struct stat sbuf;
+    
+    if ((followLinks ? stat(path, &sbuf) : lstat(path, &sbuf)) == -1) {
+        fprintf(stderr, "Error opening file %s\n", path);
+        return -1;
+    }
+    if (S_ISDIR(sbuf.st_mode)) {
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        if (!dir) {
+            fprintf(stderr, "Error opening directory %s\n", path);
+            return -1;
+        }
+        while ((entry = readdir(dir))) {
+            size_t nameLength = strlen(entry->d_name);
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+                continue;
+            }
+            // indexes made by aps index are not searched
+            if (nameLength > strlen(INDEX_EXTENSION) && !strcmp(entry->d_name + nameLength - strlen(INDEX_EXTENSION), INDEX_EXTENSION)) {
+                continue;
+            }
+            size_t length = strlen(path);
+            char *child = malloc(length + strlen(entry->d_name) + 2);
+            if (!child) {
+                closedir(dir);
+                return -1;
+            }
+            sprintf(child, length && path[length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+            // errors of one file are reported and the rest of directory is searched
+            fileListAdd(list, child, 0);
+            free(child);
+        }
+        closedir(dir);
+        return 0;
+    }
+    if (!S_ISREG(sbuf.st_mode) || sbuf.st_size == 0) {
+        return 0;
+    }
+    
+    if (list->numberOfFiles == list->capacity) {
+        unsigned long capacity = list->capacity ? list->capacity * 2 : 64;
+        searchFile *resized = realloc(list->files, capacity * sizeof(searchFile));
+        if (!resized) {
+            return -1;
+        }
+        list->files = resized;
+        list->capacity = capacity;
+    }
+    searchFile *file = &list->files[list->numberOfFiles];
+    memset(file, 0, sizeof(searchFile));
+    file->name = strdup(path);
+    if (!file->name) {
+        return -1;
+    }
+    file->size = sbuf.st_size;
+    list->numberOfFiles++;
+    list->size += file->size;
+    return 0;
+}
+
+/**
+ Function releases list of files.
+ */
+static void fileListFree(fileList *list) {
+    for (unsigned long f = 0; f < list->numberOfFiles; f++) {
+        free(list->files[f].name);
+    }
+    free(list->files);
+    memset(list, 0, sizeof(fileList));
+}
+
+/**
+ Function maps file and prepares its sink, when it is not mapped yet. Returns 0, when file can be searched.
+ */
+static int searchFileOpen(fileScheduler *scheduler, searchFile *file) {
+    pthread_mutex_lock(&file->lock);
+    if (!file->text_source && !file->failed) {
+        unsigned long long begin = profileNow();
+        int fd = open(file->name, O_RDONLY);
+        char *text = fd == -1 ? MAP_FAILED : ioMap(fd, file->size);
+        if (fd != -1) {
+            close(fd);
+        }
+        profileAdd(PROFILE_LOAD, begin);
+        if (text == MAP_FAILED) {
+            fprintf(stderr, "Error opening file %s\n", file->name);
+            file->failed = 1;
+        } else {
+            file->text_source = text;
+            // lines of file are indexed by worker, which opens it, other workers are busy with other files
+            if (sinkInit(&file->sink, text, file->size, scheduler->compiled->givenPatterns, scheduler->compiled->numberOfPatterns, scheduler->linesOption, scheduler->offsetOption, scheduler->countOption, 1)) {
+                printf("Error: Failed to allocate memory for results!\n");
+                exit(1);
+            }
+            file->sink.name = file->name;
+            sinkSetContext(&file->sink, scheduler->before, scheduler->after);
+            sinkSetLimit(&file->sink, scheduler->maxFinds, scheduler->quiet);
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+    return file->failed ? -1 : 0;
+}
+
+/**
+ Function searches one part of file. Worker which finishes the last part prints out summary of file and unmaps it. Parts after limit of file or after the first occurance of quiet search are not searched, but they are still finished, so file is released.
+ */
+static void searchFilePart(fileScheduler *scheduler, searchFile *file, unsigned long part, resultBuffer *buffer, profileWorker *worker) {
+    const searchPattern *compiled = scheduler->compiled;
+    
+    if (!searchFileOpen(scheduler, file)) {
+        unsigned long index = part * file->partSize;
+        unsigned long partSize = file->partSize + compiled->maxPatternSize - 1;
+        int stopped = scheduler->cancelled || file->sink.cancelled;
+        
+        if (index + partSize > file->size) {
+            partSize = file->size - index;
+        }
+        if (!stopped) {
+            ioPreparePart(file->text_source, file->size, index, partSize, index + file->partSize);
+        }
+        if (sinkCountOnly(&file->sink, compiled)) {
+            if (!stopped) {
+                if (bufferInitCount(buffer, &file->sink)) {
+                    printf("Error: Failed to allocate memory for results!\n");
+                    exit(1);
+                }
+                searchPart(compiled, file->text_source + index, partSize, file->partSize, index, buffer, worker);
+                bufferFinishCount(buffer);
+            }
+        } else {
+            // skipped part still lets the next one write
+            bufferInit(buffer, &file->sink, part);
+            if (!stopped) {
+                searchPart(compiled, file->text_source + index, partSize, file->partSize, index, buffer, worker);
+            }
+            bufferFinish(buffer);
+        }
+        if (scheduler->quiet && file->sink.numberOfFinds > 0) {
+            scheduler->cancelled = 1;
+        }
+    }
+    
+    if (__sync_add_and_fetch(&file->partsDone, 1) == file->numberOfParts && file->text_source) {
+        __sync_fetch_and_add(&scheduler->numberOfFinds, file->sink.numberOfFinds);
+        sinkFinish(&file->sink);
+        munmap(file->text_source, file->size);
+        file->text_source = NULL;
+    }
+}
+
+/**
+ Function takes next task from own queue or steals it from other queue. Returns 0, when there is no task left.
+ */
+static int fileSchedulerTake(fileScheduler *scheduler, size_t id, fileTask *task) {
+    for (size_t q = 0; q < scheduler->numberOfQueues; q++) {
+        taskQueue *queue = &scheduler->queues[(id + q) % scheduler->numberOfQueues];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            *task = queue->tasks[queue->head++];
+            pthread_mutex_unlock(&queue->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return 0;
+}
+
+/**
+ Thread function of multi-file search.
+ */
+static void *fileWorkerRun(void *arg) {
+    fileWorker *worker = (fileWorker *)arg;
+    fileScheduler *scheduler = worker->scheduler;
+    resultBuffer *buffer = malloc(sizeof(resultBuffer));
+    fileTask task;
+    profileWorker profiled = {"host", 0, 0, 0, 0};
+    
+    if (!buffer) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    while (fileSchedulerTake(scheduler, worker->id, &task)) {
+        for (unsigned long f = task.file; f < task.file + task.numberOfFiles; f++) {
+            searchFilePart(scheduler, &scheduler->list->files[f], task.part, buffer, &profiled);
+        }
+    }
+    profileWorkerDone(&profiled);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ Function splits files into tasks and deals them into queues of workers. Small files are batched into tasks of about FILE_BATCH_SIZE, big files are split into parts of FILE_PART_SIZE. Tasks of one file or batch go into the queue with the least work, so workers start with similar amount of work and stealing only evens out the rest.
+ */
+static void fileSchedulerPlan(fileScheduler *scheduler) {
+    fileList *list = scheduler->list;
+    size_t numberOfQueues = scheduler->numberOfQueues;
+    unsigned long numberOfTasks = 0;
+    unsigned long *load = calloc(numberOfQueues, sizeof(unsigned long));
+    fileTask *tasks;
+    size_t *owners;
+    
+    for (unsigned long f = 0; f < list->numberOfFiles; f++) {
+        searchFile *file = &list->files[f];
+        file->partSize = file->size < FILE_PART_SIZE ? file->size : FILE_PART_SIZE;
+        if (file->partSize < scheduler->compiled->maxPatternSize) {
+            file->partSize = scheduler->compiled->maxPatternSize;
+        }
+        file->numberOfParts = (file->size + file->partSize - 1) / file->partSize;
+        pthread_mutex_init(&file->lock, NULL);
+        numberOfTasks += file->numberOfParts;
+    }
+    tasks = malloc(numberOfTasks * sizeof(fileTask));
+    owners = malloc(numberOfTasks * sizeof(size_t));
+    if (!load || !tasks || !owners) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    
+    numberOfTasks = 0;
+    for (unsigned long f = 0; f < list->numberOfFiles;) {
+        unsigned long batch = 1;
+        unsigned long size = list->files[f].size;
+        size_t owner = 0;
+        
+        while (size < FILE_BATCH_SIZE && f + batch < list->numberOfFiles && list->files[f + batch].size < FILE_BATCH_SIZE) {
+            size += list->files[f + batch].size;
+            batch++;
+        }
+        for (size_t q = 1; q < numberOfQueues; q++) {
+            if (load[q] < load[owner]) {
+                owner = q;
+            }
+        }
+        load[owner] += size;
+        for (unsigned long part = 0; part < list->files[f].numberOfParts; part++) {
+            tasks[numberOfTasks].file = f;
+            tasks[numberOfTasks].numberOfFiles = batch;
+            tasks[numberOfTasks].part = part;
+            owners[numberOfTasks] = owner;
+            numberOfTasks++;
+        }
+        f += batch;
+    }
+    
+    for (size_t q = 0; q < numberOfQueues; q++) {
+        taskQueue *queue = &scheduler->queues[q];
+        queue->tasks = malloc((numberOfTasks ? numberOfTasks : 1) * sizeof(fileTask));
+        if (!queue->tasks) {
+            printf("Error: Failed to allocate memory for workers!\n");
+            exit(1);
+        }
+        queue->head = queue->tail = 0;
+        pthread_mutex_init(&queue->lock, NULL);
+    }
+    for (unsigned long t = 0; t < numberOfTasks; t++) {
+        taskQueue *queue = &scheduler->queues[owners[t]];
+        queue->tasks[queue->tail++] = tasks[t];
+    }
+    free(load);
+    free(tasks);
+    free(owners);
+}
+
+/**
+ Function searches more files with native threads. Every worker has own queue of tasks (see fileSchedulerPlan) and steals from others, when it is empty, so one big file does not leave other workers idle. Results of every file are written in order into its own sink. Returns number of workers used.
+ list               - files we are searching in
+ compiled           - compiled pattern from searchPatternInit
+ linesOption        - type of output true for printing out lines
+ offsetOption       - type of output true for printing out offset
+ countOption        - type of output true for printing out only number of occurances
+ before             - lines of context before line with occurance
+ after              - lines of context after line with occurance
+ maxFinds           - limit of occurances of every file, 0 for no limit
+ quiet              - nothing is printed out and search stops after the first occurance in any file
+ numOfWorkers       - requested number of workers, 0 means number of online processors
+ numberOfFinds      - number of occurances in all files
+ */
+static size_t findStringFiles(fileList *list,
+                       const searchPattern *compiled,
+                       int linesOption,
+                       int offsetOption,
+                       int countOption,
+                       unsigned long before,
+                       unsigned long after,
+                       unsigned long maxFinds,
+                       int quiet,
+                       size_t numOfWorkers,
+                       unsigned long *numberOfFinds) {
+    fileScheduler scheduler;
+    
+    if (numOfWorkers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numOfWorkers = online > 0 ? online : 1;
+    }
+    
+    memset(&scheduler, 0, sizeof(fileScheduler));
+    scheduler.list = list;
+    scheduler.compiled = compiled;
+    scheduler.linesOption = linesOption;
+    scheduler.offsetOption = offsetOption;
+    scheduler.countOption = countOption;
+    scheduler.before = before;
+    scheduler.after = after;
+    scheduler.maxFinds = maxFinds;
+    scheduler.quiet = quiet;
+    scheduler.numberOfQueues = numOfWorkers;
+    scheduler.queues = calloc(numOfWorkers, sizeof(taskQueue));
+    fileWorker *workers = malloc(numOfWorkers * sizeof(fileWorker));
+    pthread_t *threads = malloc(numOfWorkers * sizeof(pthread_t));
+    if (!scheduler.queues || !workers || !threads) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    fileSchedulerPlan(&scheduler);
+    
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        workers[w].scheduler = &scheduler;
+        workers[w].id = w;
+        if (pthread_create(&threads[w], NULL, fileWorkerRun, &workers[w]) != 0) {
+            printf("Error: Failed to create worker thread!\n");
+            exit(1);
+        }
+    }
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    
+    for (size_t q = 0; q < numOfWorkers; q++) {
+        free(scheduler.queues[q].tasks);
+        pthread_mutex_destroy(&scheduler.queues[q].lock);
+    }
+    for (unsigned long f = 0; f < list->numberOfFiles; f++) {
+        pthread_mutex_destroy(&list->files[f].lock);
+    }
+    free(scheduler.queues);
+    free(workers);
+    free(threads);
+    *numberOfFinds = scheduler.numberOfFinds;
+    return numOfWorkers;
+}
+
+
+/**
+ Reader of stream, which cannot be mapped (stdin, pipe). It reads stream in blocks into two buffers, so one buffer is searched while the next one is read. Every buffer has carrySize free bytes in front of block, where end of previous block is copied, so memory does not depend on length of stream.
+ */
+typedef struct {
+    int fd;
+    char *buffers[2];
+    unsigned long lengths[2];       // length of block in buffer, without carry
+    int full[2];                    // buffer is read and waits for search
+    int last[2];                    // block is the last one of stream
+    int error;
+    int regular;                    // regular file read by read or direct strategy, short read is its end
+    int follow;                     // end of file is not end of stream, reader waits for appended bytes
+    int watch;                      // inotify of followed file, -1 when it polls every FOLLOW_INTERVAL seconds
+    unsigned long carrySize;        // space in front of block in every buffer, aligned, so blocks are aligned for O_DIRECT
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} streamReader;
+
+/**
+ Function unlocks lock of reader, which is cancelled while it waits for empty buffer.
+ */
+static void streamReaderUnlock(void *arg) {
+    pthread_mutex_unlock(&((streamReader *)arg)->lock);
+}
+
+/**
+ Function waits, until something is appended to followed file. Returns -1, when following has to stop, because file was truncated (rotated log) or it cannot be watched.
+ */
+static int streamReaderWait(streamReader *reader) {
+    struct stat fileStat;
+    
+#ifdef __linux__
+    char events[FOLLOW_EVENTS_SIZE];
+    if (reader->watch >= 0) {
+        // every event of file wakes reader up, it reads everything appended since then at once
+        if (read(reader->watch, events, sizeof(events)) < 0 && errno != EINTR) {
+            return -1;
+        }
+    } else {
+        sleep(FOLLOW_INTERVAL);
+    }
+#else
+    sleep(FOLLOW_INTERVAL);
+#endif
+    if (fstat(reader->fd, &fileStat) == -1 || fileStat.st_size < lseek(reader->fd, 0, SEEK_CUR)) {
+        fprintf(stderr, "File was truncated, following stops\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ Thread function of stream reader. It fills buffers one after another and waits, when both are full. Reading stops early, when nothing more is waiting in stream, so results of slow stream are not delayed until whole block is read. Followed file is read to its end and then reader waits for appended bytes, so every block holds only new bytes. Search, which does not need rest of stream, cancels reader, also when it waits in read.
+ */
+static void *streamReaderRun(void *arg) {
+    streamReader *reader = (streamReader *)arg;
+    int b = 0;
+    int last = 0;
+    
+    while (!last) {
+        pthread_mutex_lock(&reader->lock);
+        pthread_cleanup_push(streamReaderUnlock, reader);
+        while (reader->full[b]) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        pthread_cleanup_pop(1);
+        
+        char *block = reader->buffers[b] + reader->carrySize;
+        unsigned long length = 0;
+        while (length < STREAM_BLOCK_SIZE) {
+            ssize_t count = read(reader->fd, block + length, STREAM_BLOCK_SIZE - length);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count == 0 && reader->follow) {
+                // appended bytes are searched, before reader waits for next ones
+                if (length > 0) {
+                    break;
+                }
+                if (streamReaderWait(reader)) {
+                    last = 1;
+                    break;
+                }
+                continue;
+            }
+            if (count <= 0) {
+                reader->error = count < 0;
+                last = 1;
+                break;
+            }
+            length += count;
+            if (reader->regular && length < STREAM_BLOCK_SIZE) {
+                // O_DIRECT cannot read again from unaligned end of file, followed file is searched up to its current end
+                last = !reader->follow;
+                break;
+            }
+            struct pollfd waiting = {reader->fd, POLLIN, 0};
+            if (poll(&waiting, 1, 0) == 0) {
+                break;
+            }
+        }
+        
+        pthread_mutex_lock(&reader->lock);
+        reader->lengths[b] = length;
+        reader->last[b] = last;
+        reader->full[b] = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        b ^= 1;
+    }
+    return NULL;
+}
+
+/**
+ Followed file of --follow. Checkpoint keeps state of search after every block: offset, from which file is searched again (end of block without carry), number of lines before it, last printed lines and end of last occurance of every pattern, so search started again from checkpoint prints out only what was not printed yet.
+ */
+typedef struct {
+    const char *fileName;           // inotify watches file by name
+    const char *checkpointName;     // NULL without checkpoint
+} streamFollow;
+
+/**
+ Function loads checkpoint of followed file into sink. Returns offset, from which file is searched again, and number of lines before it. Checkpoint of other patterns or of longer file (rotated log) is not used. Returns 0, when checkpoint is used.
+ */
+static int streamCheckpointLoad(const streamFollow *follow, int fd, resultSink *sink, unsigned long *offset, unsigned long *lines) {
+    FILE *checkpoint = fopen(follow->checkpointName, "r");
+    char magic[16];
+    unsigned long numberOfPatterns;
+    unsigned long lastLine, afterLine;
+    struct stat fileStat;
+    int status = -1;
+    
+    if (!checkpoint) {
+        return -1;
+    }
+    if (fscanf(checkpoint, "%15s %lu %lu %lu %lu %lu", magic, offset, lines, &lastLine, &afterLine, &numberOfPatterns) == 6 && !strcmp(magic, FOLLOW_MAGIC) && numberOfPatterns == sink->numberOfPatterns && fstat(fd, &fileStat) == 0 && *offset <= (unsigned long)fileStat.st_size) {
+        status = 0;
+        for (unsigned long p = 0; p < numberOfPatterns && !status; p++) {
+            status = fscanf(checkpoint, "%lu", &sink->nextStart[p]) == 1 ? 0 : -1;
+        }
+        sink->lastLine = lastLine;
+        sink->afterLine = afterLine;
+    }
+    fclose(checkpoint);
+    if (status) {
+        memset(sink->nextStart, 0, sink->numberOfPatterns * sizeof(unsigned long));
+        sink->lastLine = sink->afterLine = 0;
+        fprintf(stderr, "Checkpoint %s does not belong to this search, file is searched from beginning\n", follow->checkpointName);
+    }
+    return status;
+}
+
+/**
+ Function stores checkpoint of followed file. It is written into temporary file, which replaces checkpoint, so checkpoint is whole also when aps is killed.
+ */
+static void streamCheckpointStore(const streamFollow *follow, const resultSink *sink, unsigned long offset, unsigned long lines) {
+    size_t nameLength = strlen(follow->checkpointName);
+    char *temporaryName = malloc(nameLength + 5);
+    FILE *checkpoint;
+    
+    if (!temporaryName) {
+        return;
+    }
+    memcpy(temporaryName, follow->checkpointName, nameLength);
+    memcpy(temporaryName + nameLength, ".tmp", 5);
+    if ((checkpoint = fopen(temporaryName, "w"))) {
+        fprintf(checkpoint, "%s %lu %lu %lu %lu %lu", FOLLOW_MAGIC, offset, lines, sink->lastLine, sink->afterLine, sink->numberOfPatterns);
+        for (unsigned long p = 0; p < sink->numberOfPatterns; p++) {
+            fprintf(checkpoint, " %lu", sink->nextStart[p]);
+        }
+        fprintf(checkpoint, "\n");
+        if (fclose(checkpoint) == 0) {
+            rename(temporaryName, follow->checkpointName);
+        }
+    }
+    free(temporaryName);
+}
+
+/**
+ Function for searching string in stream, which cannot be mapped, like stdin or pipe, or in file read by read or direct strategy. Stream is read by streamReader and every block is searched together with end of previous block (with more workers split into parts like by findStringNativeThreads), so no occurance on border of blocks is lost. It is the last maxPatternSize - 1 bytes of previous block and for printing out lines whole unfinished line, when it is not longer than STREAM_LINE_SIZE. Occurances found twice are skipped by sink like overlapping ones. Followed file is searched the same way, only its end waits for appended bytes, so carry finds also occurances, which start in old bytes and end in new ones, and every new block costs only its own length. Returns length of stream.
+ fd                 - stream we are searching in
+ compiled           - compiled pattern from searchPatternInit
+ sink               - sink, where we are writing results, prepared without text_source
+ follow             - followed file, NULL for stream, which ends with end of file
+ numOfWorkers       - requested number of workers, 0 means number of online processors, it is set to number of workers used
+ */
+static unsigned long findStringStream(int fd, const searchPattern *compiled, resultSink *sink, const streamFollow *follow, size_t *numOfWorkers) {
+    streamReader reader;
+    pthread_t thread;
+    resultBuffer *buffer = malloc(sizeof(resultBuffer));
+    unsigned long streamOffset = 0;     // offset of current block in stream
+    unsigned long carry = 0;            // length of end of previous block in front of current block
+    unsigned long newLines = 0;         // new lines in stream before carry
+    unsigned long part = 0;
+    int b = 0;
+    struct stat fileStat;
+    profileWorker worker = {"host", 0, 0, 0, 0};
+    profileWorker *workers = NULL;      // work of workers searching parts of blocks, NULL when this thread searches blocks
+    searchJob job;
+    
+    if (*numOfWorkers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        *numOfWorkers = online > 0 ? (size_t)online : 1;
+    }
+    if (*numOfWorkers > 1) {
+        workers = malloc(*numOfWorkers * sizeof(profileWorker));
+        if (!workers) {
+            printf("Error: Failed to allocate memory for workers!\n");
+            exit(1);
+        }
+        for (size_t w = 0; w < *numOfWorkers; w++) {
+            workers[w] = worker;
+        }
+        // carry is searched again in every block, so its occurances go through sink even in count mode
+        memset(&job, 0, sizeof(searchJob));
+        job.compiled = compiled;
+        job.sink = sink;
+        job.workers = workers;
+    }
+    
+    memset(&reader, 0, sizeof(streamReader));
+    reader.fd = fd;
+    reader.regular = fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode);
+    reader.follow = follow != NULL;
+    reader.watch = -1;
+    if (follow) {
+        if (follow->checkpointName && !streamCheckpointLoad(follow, fd, sink, &streamOffset, &newLines)) {
+            lseek(fd, streamOffset, SEEK_SET);
+        }
+#ifdef __linux__
+        // watch is added before file is read, so nothing appended later is missed
+        reader.watch = inotify_init1(IN_CLOEXEC);
+        if (reader.watch >= 0 && inotify_add_watch(reader.watch, follow->fileName, IN_MODIFY | IN_ATTRIB) < 0) {
+            close(reader.watch);
+            reader.watch = -1;
+        }
+#endif
+    }
+    reader.carrySize = compiled->maxPatternSize - 1 > STREAM_LINE_SIZE ? compiled->maxPatternSize - 1 : STREAM_LINE_SIZE;
+    reader.carrySize = (reader.carrySize + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+    if (!buffer || posix_memalign((void **)&reader.buffers[0], IO_ALIGNMENT, reader.carrySize + STREAM_BLOCK_SIZE) || posix_memalign((void **)&reader.buffers[1], IO_ALIGNMENT, reader.carrySize + STREAM_BLOCK_SIZE)) {
+        printf("Error: Failed to allocate memory for stream!\n");
+        exit(1);
+    }
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.changed, NULL);
+    if (pthread_create(&thread, NULL, streamReaderRun, &reader) != 0) {
+        printf("Error: Failed to create reader thread!\n");
+        exit(1);
+    }
+    
+    for (;;) {
+        // waiting for reader is loading of stream
+        unsigned long long waited = profileNow();
+        pthread_mutex_lock(&reader.lock);
+        while (!reader.full[b]) {
+            pthread_cond_wait(&reader.changed, &reader.lock);
+        }
+        pthread_mutex_unlock(&reader.lock);
+        profileAdd(PROFILE_LOAD, waited);
+        
+        char *text_source = reader.buffers[b] + reader.carrySize - carry;
+        unsigned long text_source_size = carry + reader.lengths[b];
+        unsigned long textOffset = streamOffset - carry;
+        unsigned long textLimit = (unsigned long)-1;
+        
+        unsigned long nextCarry = compiled->maxPatternSize - 1;
+        if (nextCarry > text_source_size) {
+            nextCarry = text_source_size;
+        }
+        if (sink->linesOption && !reader.last[b]) {
+            // unfinished line is carried whole and its results are left for the next block, so the line is printed out whole
+            unsigned long line = 0;
+            while (line < text_source_size && line <= reader.carrySize && text_source[text_source_size - line - 1] != NEWLINE) {
+                line++;
+            }
+            if (line <= reader.carrySize) {
+                textLimit = textOffset + text_source_size - line;
+                // carry starts on beginning of line and it holds lines of context before, so lines of next block are whole and they can be printed as context
+                unsigned long lineStart = line;
+                unsigned long lines = 0;
+                while ((lineStart < nextCarry || lines < sink->before) && lineStart < text_source_size && lineStart <= reader.carrySize) {
+                    lines++;
+                    lineStart++;
+                    while (lineStart < text_source_size && lineStart <= reader.carrySize && text_source[text_source_size - lineStart - 1] != NEWLINE) {
+                        lineStart++;
+                    }
+                }
+                if (lineStart <= reader.carrySize) {
+                    nextCarry = lineStart;
+                } else if (line > nextCarry) {
+                    nextCarry = line;
+                }
+            }
+        }
+        
+        // every block is the next part of sink, results of previous blocks are already written
+        if (reader.lengths[b] > 0) {
+            sinkSetText(sink, text_source, text_source_size, textOffset, newLines, textLimit);
+            if (workers) {
+                job.text_source = text_source;
+                job.text_source_size = text_source_size;
+                job.textOffset = textOffset;
+                job.firstPart = part;
+                searchJobRun(&job, *numOfWorkers);
+                part += job.numberOfParts;
+            } else {
+                bufferInit(buffer, sink, part++);
+                searchPart(compiled, text_source, text_source_size, text_source_size, textOffset, buffer, &worker);
+                bufferFinish(buffer);
+            }
+            if (profile.enabled) {
+                // carry was counted in previous block already
+                (workers ? workers : &worker)->bytes -= carry;
+            }
+            // reader fills block again, when it is released
+            sinkFlushText(sink);
+        }
+        streamOffset += reader.lengths[b];
+        if (reader.last[b]) {
+            break;
+        }
+        if (sink->cancelled) {
+            // limit is reached, rest of stream is not read
+            pthread_cancel(thread);
+            break;
+        }
+        
+        if (sink->linesOption) {
+            char *position = text_source;
+            char *end = text_source + text_source_size - nextCarry;
+            while (position < end && (position = memchr(position, NEWLINE, end - position))) {
+                newLines++;
+                position++;
+            }
+        }
+        // carry space of the other buffer is never written by reader, so it can be filled while reader reads behind it
+        memcpy(reader.buffers[b ^ 1] + reader.carrySize - nextCarry, text_source + text_source_size - nextCarry, nextCarry);
+        carry = nextCarry;
+        if (follow && follow->checkpointName && reader.lengths[b] > 0) {
+            // carry is searched again after restart
+            streamCheckpointStore(follow, sink, streamOffset - carry, newLines);
+        }
+        
+        pthread_mutex_lock(&reader.lock);
+        reader.full[b] = 0;
+        pthread_cond_broadcast(&reader.changed);
+        pthread_mutex_unlock(&reader.lock);
+        b ^= 1;
+    }
+    
+    pthread_join(thread, NULL);
+    if (workers) {
+        for (size_t w = 0; w < *numOfWorkers; w++) {
+            profileWorkerDone(&workers[w]);
+        }
+        free(workers);
+    } else {
+        profileWorkerDone(&worker);
+    }
+    if (reader.error) {
+        fprintf(stderr, "Error reading input\n");
+    }
+    if (reader.watch >= 0) {
+        close(reader.watch);
+    }
+    pthread_mutex_destroy(&reader.lock);
+    pthread_cond_destroy(&reader.changed);
+    free(reader.buffers[0]);
+    free(reader.buffers[1]);
+    free(buffer);
+    return streamOffset;
+}
+
+
+/**
+ Header of trigram index of file. Index is made by aps index and it is stored next to file with extension .apsidx. Numbers are in byte order of machine, which made it.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t fileSize;              // size, modification time and identity of indexed file, index of changed or replaced file is stale
+    int64_t fileTime;
+    int64_t fileTimeNanoseconds;    // file rewritten in the same second has other nanoseconds
+    uint64_t fileDevice;
+    uint64_t fileInode;
+    uint64_t blockSize;
+    uint64_t numberOfBlocks;
+    uint64_t numberOfTrigrams;      // entries in table of trigrams
+} indexHeader;
+
+/**
+ Entry of table of trigrams, table is sorted by trigram. Posting list of trigram is list of blocks, where trigram starts. Every block is written as difference from previous block (the first one from -1) in 7 bits per byte, the highest bit says another byte follows.
+ */
+typedef struct {
+    uint32_t trigram;
+    uint32_t size;                  // length of posting list in bytes
+    uint64_t offset;                // offset of posting list in index
+} indexEntry;
+
+/**
+ Trigram index of file mapped into memory. After header there are numbers of new lines before every block and before end of file, table of trigrams and posting lists.
+ */
+typedef struct {
+    char *memblock;
+    unsigned long size;
+    const indexHeader *header;
+    const uint64_t *newLines;
+    const indexEntry *entries;
+} searchIndex;
+
+/**
+ Function returns trigram starting at text.
+ */
+static uint32_t indexTrigram(const char *text) {
+    return ((uint32_t)(unsigned char)text[0] << 16) | ((uint32_t)(unsigned char)text[1] << 8) | (unsigned char)text[2];
+}
+
+/**
+ Function returns number of bytes of value in posting list.
+ */
+static unsigned long indexVarintSize(unsigned long value) {
+    unsigned long size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+/**
+ Function writes value into posting list and returns position after it.
+ */
+static unsigned char *indexVarintWrite(unsigned char *position, unsigned long value) {
+    while (value >= 0x80) {
+        *position++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *position++ = (unsigned char)value;
+    return position;
+}
+
+/**
+ Function returns path of index of file. Returned path has to be freed.
+ */
+static char *searchIndexPath(const char *fileName) {
+    char *path = malloc(strlen(fileName) + strlen(INDEX_EXTENSION) + 1);
+    if (path) {
+        sprintf(path, "%s%s", fileName, INDEX_EXTENSION);
+    }
+    return path;
+}
+
+/**
+ Function makes trigram index of file. File is split into blocks of INDEX_BLOCK_SIZE and posting list of every trigram holds blocks, where it starts. File is read twice: the first pass measures posting lists and counts new lines, the second one writes posting lists into mapped index. Index is written under temporary name and renamed. Returns 0 on success.
+ fileName   - name of file
+ */
+static int searchIndexBuild(const char *fileName) {
+    int fd;
+    struct stat sbuf;
+    
+    if ((fd = open(fileName, O_RDONLY)) == -1 || fstat(fd, &sbuf) == -1) {
+        fprintf(stderr, "Error opening file %s\n", fileName);
+        return -1;
+    }
+    if (!S_ISREG(sbuf.st_mode) || sbuf.st_size == 0) {
+        printf("Error: Only regular non-empty file can be indexed!\n");
+        close(fd);
+        return -1;
+    }
+    unsigned long text_source_size = sbuf.st_size;
+    char *text_source = mmap(NULL, text_source_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (text_source == (caddr_t)(-1)) {
+        fprintf(stderr, "Error mapping file %s\n", fileName);
+        close(fd);
+        return -1;
+    }
+    madvise(text_source, text_source_size, MADV_SEQUENTIAL);
+    
+    // last block of every trigram (plus one) and length of its posting list, later its entry in table
+    unsigned long numberOfBlocks = (text_source_size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+    uint32_t *lastBlock = calloc(INDEX_TRIGRAMS, sizeof(uint32_t));
+    uint32_t *sizes = calloc(INDEX_TRIGRAMS, sizeof(uint32_t));
+    uint64_t *newLines = malloc((numberOfBlocks + 1) * sizeof(uint64_t));
+    if (!lastBlock || !sizes || !newLines) {
+        printf("Error: Failed to allocate memory for index!\n");
+        exit(1);
+    }
+    
+    uint64_t lines = 0;
+    for (unsigned long b = 0; b < numberOfBlocks; b++) {
+        char *position = text_source + b * INDEX_BLOCK_SIZE;
+        char *end = b == numberOfBlocks - 1 ? text_source + text_source_size : position + INDEX_BLOCK_SIZE;
+        char *last = text_source + text_source_size - 2 < end ? text_source + text_source_size - 2 : end;
+        
+        newLines[b] = lines;
+        for (char *newLine = position; newLine < end && (newLine = memchr(newLine, NEWLINE, end - newLine)); newLine++) {
+            lines++;
+        }
+        for (; position < last; position++) {
+            uint32_t trigram = indexTrigram(position);
+            if (lastBlock[trigram] != b + 1) {
+                sizes[trigram] += indexVarintSize(b + 1 - lastBlock[trigram]);
+                lastBlock[trigram] = b + 1;
+            }
+        }
+    }
+    newLines[numberOfBlocks] = lines;
+    
+    unsigned long numberOfTrigrams = 0;
+    unsigned long postingsSize = 0;
+    for (unsigned long t = 0; t < INDEX_TRIGRAMS; t++) {
+        if (sizes[t]) {
+            numberOfTrigrams++;
+            postingsSize += sizes[t];
+        }
+    }
+    unsigned long tableOffset = sizeof(indexHeader) + (numberOfBlocks + 1) * sizeof(uint64_t);
+    unsigned long postingsOffset = tableOffset + numberOfTrigrams * sizeof(indexEntry);
+    unsigned long indexSize = postingsOffset + postingsSize;
+    
+    char *path = searchIndexPath(fileName);
+    char *temporary = path ? malloc(strlen(path) + 32) : NULL;
+    if (!temporary) {
+        printf("Error: Failed to allocate memory for index!\n");
+        exit(1);
+    }
+    sprintf(temporary, "%s.%d", path, (int)getpid());
+    int indexFd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *memblock = (caddr_t)(-1);
+    if (indexFd == -1 || ftruncate(indexFd, indexSize) == -1 || (memblock = mmap(NULL, indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0)) == (caddr_t)(-1)) {
+        fprintf(stderr, "Error writing index %s\n", path);
+        if (indexFd != -1) {
+            close(indexFd);
+            unlink(temporary);
+        }
+        free(temporary);
+        free(path);
+        return -1;
+    }
+    
+    indexHeader *header = (indexHeader *)memblock;
+    memset(header, 0, sizeof(indexHeader));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->fileSize = text_source_size;
+    header->fileTime = sbuf.st_mtime;
+    header->fileTimeNanoseconds = STAT_MTIME_NSEC(sbuf);
+    header->fileDevice = sbuf.st_dev;
+    header->fileInode = sbuf.st_ino;
+    header->blockSize = INDEX_BLOCK_SIZE;
+    header->numberOfBlocks = numberOfBlocks;
+    header->numberOfTrigrams = numberOfTrigrams;
+    memcpy(memblock + sizeof(indexHeader), newLines, (numberOfBlocks + 1) * sizeof(uint64_t));
+    
+    // table of trigrams, sizes turn into entries of trigrams and cursors into their posting lists
+    indexEntry *entries = (indexEntry *)(memblock + tableOffset);
+    uint64_t *cursors = malloc((numberOfTrigrams ? numberOfTrigrams : 1) * sizeof(uint64_t));
+    if (!cursors) {
+        printf("Error: Failed to allocate memory for index!\n");
+        exit(1);
+    }
+    unsigned long offset = postingsOffset;
+    unsigned long e = 0;
+    for (unsigned long t = 0; t < INDEX_TRIGRAMS; t++) {
+        if (sizes[t]) {
+            entries[e].trigram = t;
+            entries[e].size = sizes[t];
+            entries[e].offset = offset;
+            cursors[e] = offset;
+            offset += sizes[t];
+            sizes[t] = e++;
+        }
+    }
+    
+    // the second pass writes posting lists
+    memset(lastBlock, 0, INDEX_TRIGRAMS * sizeof(uint32_t));
+    for (unsigned long b = 0; b < numberOfBlocks; b++) {
+        char *position = text_source + b * INDEX_BLOCK_SIZE;
+        char *end = b == numberOfBlocks - 1 ? text_source + text_source_size : position + INDEX_BLOCK_SIZE;
+        char *last = text_source + text_source_size - 2 < end ? text_source + text_source_size - 2 : end;
+        
+        for (; position < last; position++) {
+            uint32_t trigram = indexTrigram(position);
+            if (lastBlock[trigram] != b + 1) {
+                unsigned char *cursor = (unsigned char *)memblock + cursors[sizes[trigram]];
+                cursors[sizes[trigram]] += indexVarintWrite(cursor, b + 1 - lastBlock[trigram]) - cursor;
+                lastBlock[trigram] = b + 1;
+            }
+        }
+    }
+    
+    int err = munmap(memblock, indexSize);
+    err |= close(indexFd);
+    if (err || rename(temporary, path) == -1) {
+        fprintf(stderr, "Error writing index %s\n", path);
+        unlink(temporary);
+    } else {
+        printf("Index of %s - %lu blocks, %lu trigrams, %luB\n", fileName, numberOfBlocks, numberOfTrigrams, indexSize);
+    }
+    
+    free(cursors);
+    free(temporary);
+    free(path);
+    free(newLines);
+    free(sizes);
+    free(lastBlock);
+    munmap(text_source, text_source_size);
+    close(fd);
+    return err ? -1 : 0;
+}
+
+/**
+ Function maps index of file. Returns 0 for valid index, -1 when file has no index and 1 when index is stale (file was changed after index was made) or broken.
+ index      - index, which is mapped
+ fileName   - name of indexed file
+ fileStat   - stat of indexed file
+ */
+static int searchIndexOpen(searchIndex *index, const char *fileName, const struct stat *fileStat) {
+    char *path = searchIndexPath(fileName);
+    int fd = path ? open(path, O_RDONLY) : -1;
+    struct stat sbuf;
+    int status = 1;
+    
+    free(path);
+    memset(index, 0, sizeof(searchIndex));
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &sbuf) == 0 && (unsigned long)sbuf.st_size >= sizeof(indexHeader)) {
+        index->size = sbuf.st_size;
+        index->memblock = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (index->memblock == (caddr_t)(-1)) {
+            index->memblock = NULL;
+        }
+    }
+    close(fd);
+    if (!index->memblock) {
+        return 1;
+    }
+    
+    const indexHeader *header = (const indexHeader *)index->memblock;
+    unsigned long tableOffset = sizeof(indexHeader) + (header->numberOfBlocks + 1) * sizeof(uint64_t);
+    if (!memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC))
+        && header->fileSize == (uint64_t)fileStat->st_size
+        && header->fileTime == (int64_t)fileStat->st_mtime
+        && header->fileTimeNanoseconds == (int64_t)STAT_MTIME_NSEC(*fileStat)
+        && header->fileDevice == (uint64_t)fileStat->st_dev
+        && header->fileInode == (uint64_t)fileStat->st_ino
+        && header->blockSize > 0
+        && header->numberOfBlocks == (header->fileSize + header->blockSize - 1) / header->blockSize
+        && header->numberOfTrigrams <= INDEX_TRIGRAMS
+        && tableOffset + header->numberOfTrigrams * sizeof(indexEntry) <= index->size) {
+        index->header = header;
+        index->newLines = (const uint64_t *)(index->memblock + sizeof(indexHeader));
+        index->entries = (const indexEntry *)(index->memblock + tableOffset);
+        status = 0;
+    } else {
+        munmap(index->memblock, index->size);
+        index->memblock = NULL;
+    }
+    return status;
+}
+
+/**
+ Function unmaps index.
+ */
+static void searchIndexFree(searchIndex *index) {
+    if (index->memblock) {
+        munmap(index->memblock, index->size);
+    }
+    memset(index, 0, sizeof(searchIndex));
+}
+
+/**
+ Function returns entry of trigram in index or NULL, when trigram is not in file.
+ */
+static const indexEntry *searchIndexFind(const searchIndex *index, uint32_t trigram) {
+    unsigned long low = 0;
+    unsigned long high = index->header->numberOfTrigrams;
+    
+    while (low < high) {
+        unsigned long middle = (low + high) / 2;
+        if (index->entries[middle].trigram < trigram) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < index->header->numberOfTrigrams && index->entries[low].trigram == trigram && index->entries[low].offset + index->entries[low].size <= index->size) {
+        return &index->entries[low];
+    }
+    return NULL;
+}
+
+/**
+ Function adds blocks, where pattern can start, into candidates. Trigram at position i of pattern starts in block of occurance or in the next one, when i is smaller than block, so block is candidate, when every such trigram is in it or in the next block. Only INDEX_PATTERN_TRIGRAMS trigrams with the shortest posting lists are intersected, it is enough to skip almost all blocks.
+ index      - index of file
+ pattern    - pattern of length at least 3
+ pattern_size - length of pattern
+ candidates - candidate blocks of all patterns, blocks of pattern are added
+ blocks     - memory for two arrays with item for every block
+ */
+static void searchIndexCandidates(const searchIndex *index, const char *pattern, unsigned long pattern_size, unsigned char *candidates, unsigned char *blocks) {
+    unsigned long numberOfBlocks = index->header->numberOfBlocks;
+    unsigned char *patternCandidates = blocks;
+    unsigned char *marks = blocks + numberOfBlocks;
+    const indexEntry *chosen[INDEX_PATTERN_TRIGRAMS];
+    unsigned long numberOfChosen = 0;
+    
+    for (unsigned long i = 0; i + 2 < pattern_size && i < index->header->blockSize; i++) {
+        const indexEntry *entry = searchIndexFind(index, indexTrigram(pattern + i));
+        if (!entry) {
+            // trigram is nowhere in file, so pattern is not either
+            return;
+        }
+        // the shortest posting lists are kept sorted by insertion
+        unsigned long c = numberOfChosen;
+        for (unsigned long d = 0; d < numberOfChosen; d++) {
+            if (chosen[d] == entry) {
+                c = INDEX_PATTERN_TRIGRAMS;
+                break;
+            }
+        }
+        if (c == INDEX_PATTERN_TRIGRAMS) {
+            continue;
+        }
+        if (numberOfChosen < INDEX_PATTERN_TRIGRAMS) {
+            numberOfChosen++;
+        } else if (entry->size >= chosen[c - 1]->size) {
+            continue;
+        } else {
+            c--;
+        }
+        while (c > 0 && chosen[c - 1]->size > entry->size) {
+            chosen[c] = chosen[c - 1];
+            c--;
+        }
+        chosen[c] = entry;
+    }
+    
+    memset(patternCandidates, 1, numberOfBlocks);
+    for (unsigned long c = 0; c < numberOfChosen; c++) {
+        const unsigned char *position = (const unsigned char *)index->memblock + chosen[c]->offset;
+        const unsigned char *end = position + chosen[c]->size;
+        unsigned long block = 0;
+        
+        memset(marks, 0, numberOfBlocks);
+        while (position < end) {
+            unsigned long delta = 0;
+            int shift = 0;
+            while (position < end && (*position & 0x80)) {
+                delta |= (unsigned long)(*position++ & 0x7f) << shift;
+                shift += 7;
+            }
+            if (position < end) {
+                delta |= (unsigned long)*position++ << shift;
+            }
+            block += delta;
+            if (block == 0 || block > numberOfBlocks) {
+                break;
+            }
+            marks[block - 1] = 1;
+            if (block > 1) {
+                marks[block - 2] = 1;
+            }
+        }
+        for (unsigned long b = 0; b < numberOfBlocks; b++) {
+            patternCandidates[b] &= marks[b];
+        }
+    }
+    for (unsigned long b = 0; b < numberOfBlocks; b++) {
+        candidates[b] |= patternCandidates[b];
+    }
+}
+
+/**
+ Function finds blocks of file, where some pattern can be. Returns array with item for every block, which is 1 for candidate block, and their number, NULL when there is not enough memory.
+ */
+static unsigned char *searchIndexSelect(const searchIndex *index, const searchPattern *compiled, unsigned long *numberOfCandidates) {
+    unsigned long numberOfBlocks = index->header->numberOfBlocks;
+    unsigned char *candidates = calloc(numberOfBlocks, 1);
+    unsigned char *blocks = malloc(2 * numberOfBlocks);
+    
+    if (!candidates || !blocks) {
+        free(candidates);
+        free(blocks);
+        return NULL;
+    }
+    for (unsigned long p = 0; p < compiled->numberOfPatterns; p++) {
+        searchIndexCandidates(index, compiled->patterns[p], compiled->patternSizes[p], candidates, blocks);
+    }
+    free(blocks);
+    *numberOfCandidates = 0;
+    for (unsigned long b = 0; b < numberOfBlocks; b++) {
+        *numberOfCandidates += candidates[b];
+    }
+    return candidates;
+}
+
+/**
+ Function searches file with its trigram index. Candidate blocks of all patterns are searched by matcher of compiled pattern, runs of neighbouring blocks at once, rest of file is not read at all. With lines option every run is set into sink with its whole lines and number of lines before it is taken from index, like block of stream. Returns number of bytes searched.
+ text_source        - haystack array of characters
+ text_source_size   - length of text_source
+ index              - valid index of haystack, every pattern has at least 3 characters
+ compiled           - compiled pattern from searchPatternInit
+ candidates         - candidate blocks from searchIndexSelect
+ sink               - sink, where we are writing results, for lines option without text
+ */
+static unsigned long findStringIndexed(char *text_source, unsigned long text_source_size, const searchIndex *index, const unsigned char *candidates, const searchPattern *compiled, resultSink *sink) {
+    unsigned long numberOfBlocks = index->header->numberOfBlocks;
+    unsigned long blockSize = index->header->blockSize;
+    resultBuffer *buffer = malloc(sizeof(resultBuffer));
+    unsigned long searched = 0;
+    unsigned long part = 0;
+    profileWorker worker = {"host", 0, 0, 0, 0};
+    
+    if (!buffer) {
+        printf("Error: Failed to allocate memory for index!\n");
+        exit(1);
+    }
+    
+    for (unsigned long b = 0; b < numberOfBlocks && !sink->cancelled; b++) {
+        if (!candidates[b]) {
+            continue;
+        }
+        unsigned long e = b;
+        // with limit of sink long runs are split, so search stops soon after the last wanted occurance
+        while (e < numberOfBlocks && candidates[e] && (!sink->maxFinds || (e - b) * blockSize < STOP_PART_SIZE)) {
+            e++;
+        }
+        unsigned long start = b * blockSize;
+        unsigned long starts = (e * blockSize < text_source_size ? e * blockSize : text_source_size) - start;
+        unsigned long size = starts + compiled->maxPatternSize - 1;
+        if (start + size > text_source_size) {
+            size = text_source_size - start;
+        }
+        
+        if (sink->linesOption) {
+            // run is extended to whole lines and lines of context, lines before it are counted from the beginning of its block
+            unsigned long lineStart = start;
+            while (lineStart > 0 && text_source[lineStart - 1] != NEWLINE) {
+                lineStart--;
+            }
+            for (unsigned long l = 0; l < sink->before && lineStart > 0; l++) {
+                lineStart--;
+                while (lineStart > 0 && text_source[lineStart - 1] != NEWLINE) {
+                    lineStart--;
+                }
+            }
+            char *lineEnd = memchr(text_source + start + size - 1, NEWLINE, text_source_size - (start + size - 1));
+            unsigned long end = lineEnd ? lineEnd - text_source + 1 : text_source_size;
+            for (unsigned long l = 0; l < sink->after && end < text_source_size; l++) {
+                lineEnd = memchr(text_source + end, NEWLINE, text_source_size - end);
+                end = lineEnd ? lineEnd - text_source + 1 : text_source_size;
+            }
+            unsigned long lineBlock = lineStart / blockSize;
+            unsigned long lineOffset = index->newLines[lineBlock];
+            for (char *newLine = text_source + lineBlock * blockSize; newLine < text_source + lineStart && (newLine = memchr(newLine, NEWLINE, text_source + lineStart - newLine)); newLine++) {
+                lineOffset++;
+            }
+            sinkSetText(sink, text_source + lineStart, end - lineStart, lineStart, lineOffset, (unsigned long)-1);
+        }
+        bufferInit(buffer, sink, part++);
+        searchPart(compiled, text_source + start, size, starts, start, buffer, &worker);
+        bufferFinish(buffer);
+        searched += size;
+        b = e - 1;
+    }
+    profileWorkerDone(&worker);
+    
+    free(buffer);
+    return searched;
+}
+
+/**
+ Everything host workers and OpenCL device share, when they search one haystack together. Both take chunks of haystack from its beginning, so chunks are numbered in order of haystack and their results are written into sink as parts in this order. Every engine gets chunk as big as its share of measured throughput, so both of them finish at about the same time.
+ */
+typedef struct {
+    char *text_source;
+    unsigned long text_source_size;
+    const searchPattern *compiled;
+    resultSink *sink;
+    size_t numberOfWorkers;         // host workers, 0 when device searches alone
+    pthread_mutex_t lock;
+    unsigned long nextOffset;       // beginning of haystack, which is not taken by any engine
+    unsigned long nextPart;
+    unsigned long searched[2];      // bytes searched by host workers and by device
+    struct timespec started;
+} hybridJob;
+
+/**
+ Function prepares job of hybrid search.
+ */
+static void hybridJobInit(hybridJob *job, char *text_source, unsigned long text_source_size, const searchPattern *compiled, resultSink *sink, size_t numberOfWorkers) {
+    memset(job, 0, sizeof(hybridJob));
+    job->text_source = text_source;
+    job->text_source_size = text_source_size;
+    job->compiled = compiled;
+    job->sink = sink;
+    job->numberOfWorkers = numberOfWorkers;
+    pthread_mutex_init(&job->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+}
+
+/**
+ Function takes next chunk of haystack for engine. Device searching alone gets maxChunk. Otherwise throughput of engines is measured from start of job and engine gets half of its share of the rest of haystack (one host worker has share of all host workers divided by their number), so chunks get smaller at the end and engines finish together. Engine, which was not measured yet, gets HYBRID_MIN_CHUNK. Chunks start on pages, so pages of searched chunks can be advised. Returns length of chunk, 0 when whole haystack is taken or limit of sink is reached.
+ job        - hybrid job
+ engine     - HYBRID_HOST or HYBRID_DEVICE
+ maxChunk   - the biggest chunk engine can search at once
+ start      - beginning of chunk is written here
+ part       - part of sink for chunk is written here
+ */
+static unsigned long hybridTake(hybridJob *job, int engine, unsigned long maxChunk, unsigned long *start, unsigned long *part) {
+    unsigned long chunk = maxChunk;
+    
+    pthread_mutex_lock(&job->lock);
+    unsigned long remaining = job->text_source_size - job->nextOffset;
+    if (remaining == 0 || job->sink->cancelled) {
+        pthread_mutex_unlock(&job->lock);
+        return 0;
+    }
+    if (job->numberOfWorkers > 0) {
+        chunk = HYBRID_MIN_CHUNK;
+        if (job->searched[HYBRID_HOST] > 0 && job->searched[HYBRID_DEVICE] > 0) {
+            // both engines search for the same time, so their searched bytes are their throughputs
+            double share = (double)job->searched[engine] / (job->searched[HYBRID_HOST] + job->searched[HYBRID_DEVICE]);
+            if (engine == HYBRID_HOST) {
+                share /= job->numberOfWorkers;
+            }
+            chunk = remaining * share / 2;
+        }
+        if (chunk < HYBRID_MIN_CHUNK) {
+            chunk = HYBRID_MIN_CHUNK;
+        }
+        if (chunk > maxChunk) {
+            chunk = maxChunk;
+        }
+        if (chunk > (unsigned long)getpagesize()) {
+            chunk &= ~(unsigned long)(getpagesize() - 1);
+        }
+    }
+    if (chunk > remaining) {
+        chunk = remaining;
+    }
+    *start = job->nextOffset;
+    *part = job->nextPart++;
+    job->nextOffset += chunk;
+    pthread_mutex_unlock(&job->lock);
+    return chunk;
+}
+
+/**
+ Function adds searched chunk to throughput of engine.
+ */
+static void hybridDone(hybridJob *job, int engine, unsigned long chunk) {
+    pthread_mutex_lock(&job->lock);
+    job->searched[engine] += chunk;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ Thread function of host worker in hybrid search. Takes chunks like workers of native multithreaded search take parts, only their size changes.
+ */
+static void *hybridWorkerRun(void *arg) {
+    hybridJob *job = (hybridJob *)arg;
+    const searchPattern *compiled = job->compiled;
+    resultBuffer *buffer;
+    unsigned long start, part, chunk;
+    profileWorker worker = {"host", 0, 0, 0, 0};
+    
+    int countOnly = sinkCountOnly(job->sink, compiled);
+    
+    if (!(buffer = malloc(sizeof(resultBuffer))) || (countOnly && bufferInitCount(buffer, job->sink))) {
+        printf("Error: Failed to allocate memory for workers!\n");
+        exit(1);
+    }
+    
+    while ((chunk = hybridTake(job, HYBRID_HOST, job->sink->maxFinds ? STOP_PART_SIZE : MAX_PART_SIZE, &start, &part)) > 0) {
+        unsigned long size = chunk + compiled->maxPatternSize - 1;
+        
+        if (start + size > job->text_source_size) {
+            size = job->text_source_size - start;
+        }
+        if (!countOnly) {
+            bufferInit(buffer, job->sink, part);
+        }
+        searchPart(compiled, job->text_source + start, size, chunk, start, buffer, &worker);
+        if (countOnly) {
+            bufferFlushCount(buffer);
+        } else {
+            bufferFinish(buffer);
+        }
+        hybridDone(job, HYBRID_HOST, chunk);
+    }
+    
+    if (countOnly) {
+        bufferFinishCount(buffer);
+    }
+    profileWorkerDone(&worker);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ Plan of OpenCL search, which says how many work items search one window and whether tiled kernels are used. Plan is chosen by calibration for every device and class of pattern and it is cached.
+ */
+typedef struct {
+    size_t global;                      // the most work items for one window
+    size_t local;                       // size of work-group for tiled kernels, 0 for run kernels
+    unsigned long tileSize;             // number of positions in one tile of tiled kernels
+    int calibrated;                     // plan was measured, it is not default one
+} openCLPlan;
+
+/**
+ OpenCL runtime, which is prepared once and then used by every search with -t. In serve mode (see serve) it lives as long as program, so queries do not create context and build program again.
+ */
+typedef struct {
+    cl_device_id device_id;             // compute device id
+    cl_context context;                 // compute context
+    cl_command_queue commands;          // compute command queue
+    cl_program program;                 // compute program
+    cl_kernel run;                      // kernel writing offsets
+    cl_kernel runCount;                 // kernel counting occurances of every thread
+    cl_kernel scan;                     // kernel turning counts into offsets for run
+    cl_kernel tiledCount;               // runCount for work-groups with tiles in local memory
+    cl_kernel tiled;                    // run for work-groups with tiles in local memory
+    cl_ulong maxMemAlloc;
+    cl_ulong localMemSize;
+    size_t groupSize;                   // the biggest work-group of tiled kernels
+    size_t groupMultiple;               // preferred multiple of work-group size
+    cl_uint computeUnits;
+    int cached;                         // program was loaded from cache of binaries
+    openCLPlan plans[OPENCL_PATTERN_CLASSES]; // plans for classes of pattern, which are known already
+} openCLRuntime;
+
+/**
+ One window of haystack searched by OpenCL. Window has its own input buffer over mapped file and one of two pairs of counts and output buffers, so next window is counted, while results of previous one are read.
+ */
+typedef struct {
+    unsigned long start;            // offset of window in haystack
+    unsigned long size;             // length of window with overlap of pattern_size - 1
+    unsigned long chunk;            // length of window without overlap
+    unsigned long part;             // part of sink for results of window
+    size_t global;                  // number of threads
+    cl_mem input;
+    cl_event counted;               // counts of window are scanned into offsets
+    cl_event searched;              // matches of window are written
+} openCLWindow;
+
+/**
+ Function prepares window of haystack and enqueues count pass over it. Kernel runCount (or tiledCount) writes number of matches of every thread into counts and kernel scan turns them into offsets and appends their sum. Number of threads is written into window. Returns 0 on success, otherwise window has no input and reason is in error.
+ runtime            - OpenCL runtime with pattern already set into kernels
+ text_source        - haystack array of characters
+ pattern_size       - length of pattern
+ window             - window with start and size set
+ counts             - counts buffer of window, it has room for plan->global + 1 items
+ plan               - plan of search from openCLRuntimePlan
+ error              - buffer of APS_ERROR_SIZE bytes for reason of failure
+ */
+static int openCLWindowCount(const openCLRuntime *runtime,
+                         char *text_source,
+                         unsigned long pattern_size,
+                         openCLWindow *window,
+                         cl_mem counts,
+                         const openCLPlan *plan,
+                         char *error) {
+    int err;
+    size_t one = 1;
+    size_t local = plan->local;
+    unsigned long tileSize = plan->tileSize;
+    cl_kernel kernel = local ? runtime->tiledCount : runtime->runCount;
+    
+    // Compute number of workers (threads) for this window, small windows get less of them
+    if (local) {
+        // one work-group for every tile, but at most plan->global work items
+        size_t groups = (window->size + tileSize - 1) / tileSize;
+        if (groups > plan->global / local) {
+            groups = plan->global / local;
+        }
+        window->global = groups * local;
+    } else {
+        window->global = plan->global;
+        if ((window->size / (pattern_size * MIN_PART_SIZE_FACTOR)) < window->global) {
+            window->global = (window->size / (pattern_size * MIN_PART_SIZE_FACTOR)) ;
+        }
+        if (window->global == 0) {
+            window->global = 1;
+        }
+    }
+    
+    window->counted = NULL;
+    window->input = clCreateBuffer(runtime->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(char) * window->size, text_source + window->start, &err);
+    if (err)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", err);
+        window->input = NULL;
+        return -1;
+    }
+    
+    // Arguments are taken when kernel is enqueued, so kernel can be reused for next window right away
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &window->input);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &counts);
+    err |= clSetKernelArg(kernel, 5, sizeof(unsigned long), &window->size);
+    if (local) {
+        err |= clSetKernelArg(kernel, 7, sizeof(unsigned long), &tileSize);
+        err |= clSetKernelArg(kernel, 8, tileSize + pattern_size - 1, NULL);
+        err |= clSetKernelArg(kernel, 9, pattern_size, NULL);
+    }
+    err |= clSetKernelArg(runtime->scan, 0, sizeof(cl_mem), &counts);
+    err |= clSetKernelArg(runtime->scan, 1, sizeof(unsigned long), &window->global);
+    if (err != CL_SUCCESS)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to set kernel arguments! %d", err);
+        clReleaseMemObject(window->input);
+        window->input = NULL;
+        return -1;
+    }
+    
+    err = clEnqueueNDRangeKernel(runtime->commands, kernel, 1, NULL, &window->global, local ? &local : NULL, 0, NULL, NULL);
+    if (err == CL_SUCCESS) {
+        err = clEnqueueNDRangeKernel(runtime->commands, runtime->scan, 1, NULL, &one, NULL, 0, NULL, &window->counted);
+    }
+    if (err)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to execute kernel! %d", err);
+        // count pass, which was enqueued, still reads input, so it is waited for
+        clFinish(runtime->commands);
+        clReleaseMemObject(window->input);
+        window->input = NULL;
+        window->counted = NULL;
+        return -1;
+    }
+    clFlush(runtime->commands);
+    return 0;
+}
+
+/**
+ Function enqueues write pass over counted window. Kernel run (or tiled) writes matches of every thread from its offset in counts, so output holds dense sorted offsets of matches in window.
+ runtime            - OpenCL runtime with pattern already set into kernels
+ pattern_size       - length of pattern
+ window             - counted window
+ counts             - counts buffer of window with offsets
+ output             - output buffer, it has room for all matches of window
+ outputReleased     - event of previous window, which read the same output buffer, NULL for none
+ plan               - plan of search from openCLRuntimePlan
+ error              - buffer of APS_ERROR_SIZE bytes for reason of failure
+ Returns 0 on success.
+ */
+static int openCLWindowWrite(const openCLRuntime *runtime,
+                       unsigned long pattern_size,
+                       openCLWindow *window,
+                       cl_mem counts,
+                       cl_mem output,
+                       cl_event outputReleased,
+                       const openCLPlan *plan,
+                       char *error) {
+    int err;
+    size_t local = plan->local;
+    unsigned long tileSize = plan->tileSize;
+    cl_kernel kernel = local ? runtime->tiled : runtime->run;
+    
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &window->input);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
+    err |= clSetKernelArg(kernel, 5, sizeof(unsigned long), &window->size);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &counts);
+    if (local) {
+        err |= clSetKernelArg(kernel, 8, sizeof(unsigned long), &tileSize);
+        err |= clSetKernelArg(kernel, 9, tileSize + pattern_size - 1, NULL);
+        err |= clSetKernelArg(kernel, 10, pattern_size, NULL);
+        err |= clSetKernelArg(kernel, 11, local * sizeof(cl_uint), NULL);
+    }
+    if (err != CL_SUCCESS)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to set kernel arguments! %d", err);
+        return -1;
+    }
+    
+    err = clEnqueueNDRangeKernel(runtime->commands, kernel, 1, NULL, &window->global, local ? &local : NULL, outputReleased ? 1 : 0, outputReleased ? &outputReleased : NULL, &window->searched);
+    if (err)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to execute kernel! %d", err);
+        window->searched = NULL;
+        return -1;
+    }
+    clFlush(runtime->commands);
+    return 0;
+}
+
+/**
+ Function takes next window of hybrid job for device and extends it by pattern_size - 1 characters. Returns 0, when whole haystack is taken.
+ */
+static int openCLWindowTake(hybridJob *job, openCLWindow *window, unsigned long windowSize, unsigned long pattern_size) {
+    window->chunk = hybridTake(job, HYBRID_DEVICE, windowSize, &window->start, &window->part);
+    if (window->chunk == 0) {
+        return 0;
+    }
+    window->size = window->chunk + pattern_size - 1;
+    if (window->start + window->size > job->text_source_size) {
+        window->size = job->text_source_size - window->start;
+    }
+    return 1;
+}
+
+/**
+ Function for searching string in string using KMP algorithm using OpenCL multithreading. Writes all occurances and their offset from beginning into sink. Returns 0 on success, otherwise sink is cancelled, so host workers stop, and reason is in error.
+ Haystack is searched in windows taken from hybrid job, alone or together with host workers, so file is not limited by memory device can allocate. Every window is extended by pattern_size - 1 characters, so occurance on border of windows is found only in window it starts in. Every window is searched in two passes: count pass with scan of counts on device gives number of matches and offset of every thread, then write pass writes dense sorted matches. Plan says how many work items search window and whether tiled kernels are used: work-group of tiled kernels loads tile of window and pattern into local memory and its work items check neighbouring positions, so reads from global memory are coalesced. Host reads only number of matches and matches themselves, in count mode only number of matches. Windows are pipelined: count pass of next window is enqueued before results of current one are read through second queue, so device searches while host writes results. Output buffers grow with number of matches, pages of searched windows are released, so memory does not depend on size of file.
+ runtime            - OpenCL runtime from openCLRuntimeInit
+ plan               - plan of search from openCLRuntimePlan
+ job                - hybrid job with haystack, compiled pattern (kernels use always KMP) and sink, where we are writing results
+ numOfThreads       - number of threads used in the biggest window is written here
+ error              - buffer of APS_ERROR_SIZE bytes for reason of failure
+ */
+static int findStringMultiThread(const openCLRuntime *runtime,
+                const openCLPlan *plan,
+                hybridJob *job,
+                size_t *numOfThreads,
+                char *error) {
+   
+    int err;                            // error code returned from api calls
+    int status = -1;
+    
+    
+    cl_mem patternMem = NULL;           // device memory used for the pattern array
+    cl_mem computePatternMem = NULL;
+    cl_mem foldMem = NULL;              // device memory used for folding table of haystack
+    cl_mem stopMem = NULL;              // device memory used for limit of matches and matches found by count pass
+    cl_mem counts[2] = {NULL, NULL};    // device memory used for counts and offsets of threads of two windows
+    cl_mem outputs[2] = {NULL, NULL};   // device memory used for the output arrays of two windows
+    unsigned long outputSizes[2] = {0, 0};
+    cl_event released[2] = {NULL, NULL};// output buffer was read and unmapped
+    openCLWindow windows[2];
+    int taken[2] = {0, 0};              // part of window is taken, but its results are not in sink yet
+    cl_command_queue reads = NULL;      // queue for reading results, so it does not wait for kernel of next window
+    resultBuffer *buffer = NULL;
+    int draining = 0;                   // buffer is initialized for part of current window
+    unsigned long w = 0;
+    profileWorker worker = {"device", 0, 0, 0, 0};
+    char *text_source = job->text_source;
+    unsigned long text_source_size = job->text_source_size;
+    const searchPattern *compiled = job->compiled;
+    resultSink *sink = job->sink;
+    
+    *numOfThreads = 0;
+    memset(windows, 0, sizeof(windows));
+    
+    char *pattern = compiled->pattern;
+    unsigned long pattern_size = compiled->pattern_size;
+    int *pi = compiled->pi;
+    
+    if (pattern_size > text_source_size) {
+        // no occurance fits into haystack, sink reports no match like searches on host
+        return 0;
+    }
+    
+    // Window can match on every character, so output of window has to fit into device memory
+    unsigned long windowSize = OPENCL_WINDOW_SIZE;
+    unsigned long maxWindowSize = runtime->maxMemAlloc / sizeof(unsigned long);
+    if (maxWindowSize < 2 * pattern_size) {
+        snprintf(error, APS_ERROR_SIZE, "Device cannot allocate window for pattern!");
+        goto cleanup;
+    }
+    if (windowSize + pattern_size > maxWindowSize) {
+        windowSize = maxWindowSize - pattern_size;
+    }
+    // windows start on pages, so their pages can be advised
+    if (windowSize > (unsigned long)getpagesize()) {
+        windowSize &= ~(unsigned long)(getpagesize() - 1);
+    }
+    if (windowSize > text_source_size) {
+        windowSize = text_source_size;
+    }
+    
+    
+    
+   
+    
+    // Create the input and output arrays in device memory for our calculation
+    //
+    int error_code = 0;
+    
+    patternMem = clCreateBuffer(runtime->context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(char) * pattern_size, pattern, &error_code);
+    if (error_code)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+        goto cleanup;
+    }
+    computePatternMem = clCreateBuffer(runtime->context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(int) * pattern_size, pi, &error_code);
+    if (error_code)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+        goto cleanup;
+    }
+    foldMem = clCreateBuffer(runtime->context,  CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,  sizeof(compiled->fold), (void *)compiled->fold, &error_code);
+    if (error_code)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+        goto cleanup;
+    }
+    
+    // Every thread has its count and one more item holds number of matches of window.
+    // In count mode of pattern, which cannot overlap, number of matches is the result, so matches are not written at all.
+    int countOnly = sinkCountOnly(sink, compiled);
+    // Count pass stops, when all work items found limit of matches together, only in count mode, otherwise write pass needs exact counts
+    cl_uint stop[2] = {0, 0};
+    if (countOnly && sink->maxFinds) {
+        stop[0] = sink->maxFinds < (cl_uint)-1 ? (cl_uint)sink->maxFinds : (cl_uint)-1;
+    }
+    stopMem = clCreateBuffer(runtime->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(stop), stop, &error_code);
+    if (error_code)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+        goto cleanup;
+    }
+    for (int o = 0; o < 2; o++) {
+        counts[o] = clCreateBuffer(runtime->context, CL_MEM_READ_WRITE, (plan->global + 1) * sizeof(unsigned long), NULL, &error_code);
+        if (error_code)
+        {
+            snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+            counts[o] = NULL;
+            goto cleanup;
+        }
+    }
+    
+    reads = clCreateCommandQueue(runtime->context, runtime->device_id, 0, &err);
+    if (!reads)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to create a command commands!");
+        goto cleanup;
+    }
+    
+    
+    // Set the arguments, which are the same for all windows
+    //
+    
+    err = 0;
+    cl_kernel kernels[] = {runtime->runCount, runtime->run, runtime->tiledCount, runtime->tiled};
+    for (int k = 0; k < 4; k++) {
+        err |= clSetKernelArg(kernels[k], 2, sizeof(cl_mem), &patternMem);
+        err |= clSetKernelArg(kernels[k], 3, sizeof(cl_mem), &computePatternMem);
+        err |= clSetKernelArg(kernels[k], 4, sizeof(unsigned long), &pattern_size);
+        err |= clSetKernelArg(kernels[k], 6, sizeof(cl_mem), &foldMem);
+    }
+    err |= clSetKernelArg(runtime->runCount, 7, sizeof(cl_mem), &stopMem);
+    err |= clSetKernelArg(runtime->tiledCount, 10, sizeof(cl_mem), &stopMem);
+    
+    
+    if (err != CL_SUCCESS)
+    {
+        snprintf(error, APS_ERROR_SIZE, "Failed to set kernel arguments! %d", err);
+        goto cleanup;
+    }
+    
+    buffer = malloc(sizeof(resultBuffer));
+    if (!buffer) {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate memory for results!");
+        goto cleanup;
+    }
+    
+    // Count the first window, the next ones are counted one window ahead
+    int hasWindow = taken[0] = openCLWindowTake(job, &windows[0], windowSize, pattern_size);
+    if (hasWindow && openCLWindowCount(runtime, text_source, pattern_size, &windows[0], counts[0], plan, error)) {
+        goto cleanup;
+    }
+    for (w = 0; hasWindow; w++) {
+        openCLWindow *window = &windows[w % 2];
+        unsigned long numberOfMatches;
+        
+        if (window->global > *numOfThreads) {
+            *numOfThreads = window->global;
+        }
+        
+        // Only number of matches is read, so it is known how big output of window is, host waits here for count pass
+        unsigned long long counted = profileNow();
+        err = clEnqueueReadBuffer(reads, counts[w % 2], CL_TRUE, window->global * sizeof(unsigned long), sizeof(unsigned long), &numberOfMatches, 1, &window->counted, NULL);
+        if (err != CL_SUCCESS)
+        {
+            snprintf(error, APS_ERROR_SIZE, "Failed to read output array! %d", err);
+            goto cleanup;
+        }
+        profileAdd(PROFILE_KERNEL, counted);
+        if (profile.enabled) {
+            worker.bytes += window->chunk;
+            worker.matches += numberOfMatches;
+            worker.parts++;
+            worker.busy += profileNow() - counted;
+        }
+        clReleaseEvent(window->counted);
+        window->counted = NULL;
+        
+        window->searched = NULL;
+        if (countOnly) {
+            // counts of every window go to sink, so limit stops taking next windows
+            sinkCount(sink, &numberOfMatches);
+        } else if (numberOfMatches > 0 && !sink->cancelled) {
+            // output buffer grows twice, so it is not created for every window
+            if (numberOfMatches > outputSizes[w % 2]) {
+                if (outputs[w % 2]) {
+                    clReleaseMemObject(outputs[w % 2]);
+                }
+                outputSizes[w % 2] = numberOfMatches > 2 * outputSizes[w % 2] ? numberOfMatches : 2 * outputSizes[w % 2];
+                if (outputSizes[w % 2] > windowSize + pattern_size) {
+                    outputSizes[w % 2] = windowSize + pattern_size;
+                }
+                outputs[w % 2] = clCreateBuffer(runtime->context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, outputSizes[w % 2] * sizeof(unsigned long), NULL, &error_code);
+                if (error_code)
+                {
+                    snprintf(error, APS_ERROR_SIZE, "Failed to allocate device memory with code %d!", error_code);
+                    outputs[w % 2] = NULL;
+                    goto cleanup;
+                }
+            }
+            if (openCLWindowWrite(runtime, pattern_size, window, counts[w % 2], outputs[w % 2], released[w % 2], plan, error)) {
+                goto cleanup;
+            }
+            if (released[w % 2]) {
+                clReleaseEvent(released[w % 2]);
+                released[w % 2] = NULL;
+            }
+        }
+        
+        // Device counts next window, while matches of this one are drained into sink
+        openCLWindow *next = &windows[(w + 1) % 2];
+        hasWindow = taken[(w + 1) % 2] = openCLWindowTake(job, next, windowSize, pattern_size);
+        if (hasWindow) {
+            // pages of next window are read from disk, while current one is searched
+            madvise(text_source + next->start, next->size, MADV_WILLNEED);
+            if (openCLWindowCount(runtime, text_source, pattern_size, next, counts[(w + 1) % 2], plan, error)) {
+                goto cleanup;
+            }
+        }
+        
+        // Read back the results from the device and drain them into sink as part of window
+        //
+        if (!countOnly) {
+            bufferInit(buffer, sink, window->part);
+            draining = 1;
+        }
+        if (window->searched) {
+            // host waits for write pass and mapping of matches
+            unsigned long long mapped = profileNow();
+            unsigned long *results = clEnqueueMapBuffer(reads, outputs[w % 2], CL_TRUE, CL_MAP_READ, 0, numberOfMatches * sizeof(unsigned long), 1, &window->searched, NULL, &err);
+            if (!results || err != CL_SUCCESS)
+            {
+                snprintf(error, APS_ERROR_SIZE, "Failed to read output array! %d", err);
+                goto cleanup;
+            }
+            profileAdd(PROFILE_READBACK, mapped);
+            for (unsigned long i = 0; i < numberOfMatches; i++) {
+                bufferPush(buffer, window->start + results[i], 0);
+            }
+            err = clEnqueueUnmapMemObject(reads, outputs[w % 2], results, 0, NULL, &released[w % 2]);
+            if (err != CL_SUCCESS)
+            {
+                snprintf(error, APS_ERROR_SIZE, "Failed to read output array! %d", err);
+                released[w % 2] = NULL;
+                goto cleanup;
+            }
+            clFlush(reads);
+            clReleaseEvent(window->searched);
+            window->searched = NULL;
+        }
+        if (!countOnly) {
+            bufferFinish(buffer);
+            draining = 0;
+        }
+        taken[w % 2] = 0;
+        clReleaseMemObject(window->input);
+        window->input = NULL;
+        hybridDone(job, HYBRID_DEVICE, window->chunk);
+        // searched window is not needed anymore, its pages are read again from file only when line of later result starts in it
+        if (hasWindow) {
+            madvise(text_source + window->start, window->chunk, MADV_DONTNEED);
+        }
+    }
+    status = 0;
+    
+cleanup:
+    if (status) {
+        // host workers do not take next chunks and parts taken by device are finished empty, so workers waiting for them go on
+        pthread_mutex_lock(&sink->lock);
+        sink->cancelled = 1;
+        pthread_mutex_unlock(&sink->lock);
+        if (draining) {
+            bufferFinish(buffer);
+            taken[w % 2] = 0;
+        }
+        for (int o = 0; o < 2; o++) {
+            openCLWindow *window = &windows[(w + o) % 2];
+            if (taken[(w + o) % 2] && !sinkCountOnly(sink, compiled)) {
+                bufferInit(buffer, sink, window->part);
+                bufferFinish(buffer);
+            }
+        }
+    }
+    if (reads) {
+        clFinish(reads);
+        clReleaseCommandQueue(reads);
+    }
+    clFinish(runtime->commands);
+    free(buffer);
+    profileWorkerDone(&worker);
+    
+    for (int o = 0; o < 2; o++) {
+        if (windows[o].counted) {
+            clReleaseEvent(windows[o].counted);
+        }
+        if (windows[o].searched) {
+            clReleaseEvent(windows[o].searched);
+        }
+        if (windows[o].input) {
+            clReleaseMemObject(windows[o].input);
+        }
+        if (released[o]) {
+            clReleaseEvent(released[o]);
+        }
+        if (outputs[o]) {
+            clReleaseMemObject(outputs[o]);
+        }
+        if (counts[o]) {
+            clReleaseMemObject(counts[o]);
+        }
+    }
+    if (patternMem) {
+        clReleaseMemObject(patternMem);
+    }
+    if (computePatternMem) {
+        clReleaseMemObject(computePatternMem);
+    }
+    if (foldMem) {
+        clReleaseMemObject(foldMem);
+    }
+    if (stopMem) {
+        clReleaseMemObject(stopMem);
+    }
+    return status;
+}
+
+/**
+ Function searches haystack with OpenCL device and host workers together. Host workers run matcher of compiled pattern in their threads, this thread drives device with findStringMultiThread. Returns 0 on success, otherwise host workers are stopped and reason is in error.
+ runtime            - OpenCL runtime from openCLRuntimeInit
+ plan               - plan of search from openCLRuntimePlan
+ text_source        - haystack array of characters
+ text_source_size   - length of text_source
+ compiled           - compiled pattern from searchPatternInit
+ sink               - sink, where we are writing results
+ numOfWorkers       - number of host workers, 0 means that device searches alone
+ numOfThreads       - number of threads used is written here: the biggest window of device and host workers
+ deviceSearched     - number of bytes searched by device is written here
+ error              - buffer of APS_ERROR_SIZE bytes for reason of failure
+ */
+static int findStringHybrid(const openCLRuntime *runtime,
+                        const openCLPlan *plan,
+                        char* text_source,
+                        unsigned long text_source_size,
+                        const searchPattern *compiled,
+                        resultSink *sink,
+                        size_t numOfWorkers,
+                        size_t *numOfThreads,
+                        unsigned long *deviceSearched,
+                        char *error) {
+    hybridJob job;
+    pthread_t *threads = NULL;
+    
+    if (numOfWorkers > 0 && !(threads = malloc(numOfWorkers * sizeof(pthread_t)))) {
+        snprintf(error, APS_ERROR_SIZE, "Failed to allocate memory for workers!");
+        return -1;
+    }
+    hybridJobInit(&job, text_source, text_source_size, compiled, sink, numOfWorkers);
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        if (pthread_create(&threads[w], NULL, hybridWorkerRun, &job) != 0) {
+            // device searches with workers, which were created
+            pthread_mutex_lock(&job.lock);
+            job.numberOfWorkers = numOfWorkers = w;
+            pthread_mutex_unlock(&job.lock);
+            break;
+        }
+    }
+    
+    int status = findStringMultiThread(runtime, plan, &job, numOfThreads, error);
+    
+    for (size_t w = 0; w < numOfWorkers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    *numOfThreads += numOfWorkers;
+    *deviceSearched = job.searched[HYBRID_DEVICE];
+    return status;
+}
+
+/**
+ Source string of kernels, it is the same as main.cl.
+ */
+static const char* source_str =
+    "__kernel void kmp(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned char* fold, __global unsigned long *output, unsigned long index)"
+    "{"
+    "    unsigned long i;"
+    "    unsigned long counter = 0;"
+    "    unsigned char c;"
+    "    int k = -1;"
+    "    if (!pi){"
+    "        return;"
     "    }"
-    "    unsigned long index = counter;"
     "    for (i = 0; i < tsize; i++) {"
-    "        while (k > -1 && pattern[k+1] != target[i])"
+    "        if (k == -1) {"
+    "            while (i + psize <= tsize && (fold[(unsigned char)target[i]] != (unsigned char)pattern[0] || fold[(unsigned char)target[i + psize - 1]] != (unsigned char)pattern[psize - 1]))"
+    "                i++;"
+    "            if (i + psize > tsize)"
+    "                break;"
+    "        }"
+    "        c = fold[(unsigned char)target[i]];"
+    "        while (k > -1 && (unsigned char)pattern[k+1] != c)"
     "            k = pi[k];"
-    "        if (target[i] == pattern[k+1])"
+    "        if (c == (unsigned char)pattern[k+1])"
     "            k++;"
     "        if (k == psize - 1) {"
     "            output[counter] = index + i - k;"
     "            counter++;"
-    "            k = -1;"
+    "            k = pi[k];"
     "        }"
     "    }"
-    "    output[counter] = -1;"
     "    return;"
     "}"
-    "__kernel void run(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize)"
+    "__kernel void kmpCount(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned char* fold, __global unsigned long *output, unsigned long threadId, volatile __global unsigned int* stop)"
+    "{"
+    "    unsigned long i;"
+    "    unsigned long counter = 0;"
+    "    unsigned long check = 0;"
+    "    unsigned int limit = stop[0];"
+    "    unsigned char c;"
+    "    int k = -1;"
+    "    for (i = 0; i < tsize; i++) {"
+    "        /* matches of other work items are checked only once in a while, so limit costs nearly nothing */"
+    "        if (limit && i >= check) {"
+    "            if (stop[1] >= limit) {"
+    "                break;"
+    "            }"
+    "            check = i + 4096;"
+    "        }"
+    "        if (k == -1) {"
+    "            while (i + psize <= tsize && (fold[(unsigned char)target[i]] != (unsigned char)pattern[0] || fold[(unsigned char)target[i + psize - 1]] != (unsigned char)pattern[psize - 1]))"
+    "                i++;"
+    "            if (i + psize > tsize)"
+    "                break;"
+    "        }"
+    "        c = fold[(unsigned char)target[i]];"
+    "        while (k > -1 && (unsigned char)pattern[k+1] != c)"
+    "            k = pi[k];"
+    "        if (c == (unsigned char)pattern[k+1])"
+    "            k++;"
+    "        if (k == psize - 1) {"
+    "            counter++;"
+    "            k = pi[k];"
+    "            if (limit) {"
+    "                atomic_inc(&stop[1]);"
+    "            }"
+    "        }"
+    "    }"
+    "    output[threadId] = counter;"
+    "}"
+    "__kernel void scan(__global unsigned long* counts, unsigned long numberOfCounts)"
+    "{"
+    "    unsigned long i;"
+    "    unsigned long sum = 0;"
+    "    /* there is count for every thread of run, so there are only few of them and one work item scans them */"
+    "    if (get_global_id(0) != 0) {"
+    "        return;"
+    "    }"
+    "    for (i = 0; i < numberOfCounts; i++) {"
+    "        unsigned long count = counts[i];"
+    "        counts[i] = sum;"
+    "        sum += count;"
+    "    }"
+    "    counts[numberOfCounts] = sum;"
+    "}"
+    "__kernel void run(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize, __global unsigned char* fold, __global unsigned long* offsets)"
+    "{"
+    "    int threadId = get_global_id(0);"
+    "    unsigned long partSize = inputSize / get_global_size(0);"
+    "    if (partSize < psize) {"
+    "        partSize = psize;"
+    "    }"
+    "    if (threadId * partSize >= inputSize) {"
+    "        return;"
+    "    }"
+    "    unsigned long index = threadId * partSize;"
+    "    unsigned long size = partSize + psize - 1;"
+    "    if (threadId == get_global_size(0) - 1 || index + size > inputSize) {"
+    "        size = inputSize - index;"
+    "    }"
+    "    kmp(input + (index), size, pattern, pi, psize, fold, output + offsets[threadId], index);"
+    "}"
+    "__kernel void runCount(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize, __global unsigned char* fold, volatile __global unsigned int* stop)"
     "{"
     "    int threadId = get_global_id(0);"
     "    unsigned long partSize = inputSize / get_global_size(0);"
@@ -378,257 +4564,1862 @@ int main(int argc, char** argv)
     "        partSize = psize;"
     "    }"
     "    if (threadId * partSize >= inputSize) {"
+    "        output[threadId] = 0;"
     "        return;"
     "    }"
     "    unsigned long index = threadId * partSize;"
-    "    if (index + psize - 1 > inputSize) {"
-    "        kmp(input + (index), partSize, pattern, pi, psize, output, index);"
-    "    }else {"
-    "        kmp(input + (index), partSize + psize - 1, pattern, pi, psize, output, index);"
+    "    unsigned long size = partSize + psize - 1;"
+    "    if (threadId == get_global_size(0) - 1 || index + size > inputSize) {"
+    "        size = inputSize - index;"
+    "    }"
+    "    kmpCount(input + (index), size, pattern, pi, psize, fold, output, threadId, stop);"
+    "}"
+    "int tileMatch(__local char* text, __local char* pattern, unsigned long psize)"
+    "{"
+    "    unsigned long j;"
+    "    if (text[0] != pattern[0] || text[psize - 1] != pattern[psize - 1]) {"
+    "        return 0;"
+    "    }"
+    "    for (j = 1; j + 1 < psize; j++) {"
+    "        if (text[j] != pattern[j]) {"
+    "            return 0;"
+    "        }"
+    "    }"
+    "    return 1;"
+    "}"
+    "__kernel void tiledCount(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi, unsigned long psize, unsigned long inputSize, __global unsigned char* fold, unsigned long tileSize, __local char* tile, __local char* localPattern, volatile __global unsigned int* stop)"
+    "{"
+    "    unsigned long localId = get_local_id(0);"
+    "    unsigned long localSize = get_local_size(0);"
+    "    unsigned long groups = get_num_groups(0);"
+    "    unsigned long partSize = inputSize / groups;"
+    "    unsigned long counter = 0;"
+    "    unsigned long i, start, end, tileStart, positions;"
+    "    unsigned int limit = stop[0];"
+    "    /* the whole group returns together, so nobody waits on barrier */"
+    "    if (inputSize < psize) {"
+    "        output[get_global_id(0)] = 0;"
+    "        return;"
+    "    }"
+    "    if (partSize < psize) {"
+    "        partSize = psize;"
+    "    }"
+    "    /* work-group checks positions from start to end, every match starts in part of one group */"
+    "    start = get_group_id(0) * partSize;"
+    "    end = start + partSize;"
+    "    if (get_group_id(0) == groups - 1 || end > inputSize - psize + 1) {"
+    "        end = inputSize - psize + 1;"
+    "    }"
+    "    for (i = localId; i < psize; i += localSize) {"
+    "        localPattern[i] = pattern[i];"
+    "    }"
+    "    for (tileStart = start; tileStart < end; tileStart += tileSize) {"
+    "        positions = end - tileStart < tileSize ? end - tileStart : tileSize;"
+    "        /* previous tile is not read anymore */"
+    "        barrier(CLK_LOCAL_MEM_FENCE);"
+    "        if (limit) {"
+    "            /* the first work item decides for the whole group, so the group stops together */"
+    "            if (localId == 0) {"
+    "                tile[0] = stop[1] >= limit;"
+    "            }"
+    "            barrier(CLK_LOCAL_MEM_FENCE);"
+    "            if (tile[0]) {"
+    "                break;"
+    "            }"
+    "            barrier(CLK_LOCAL_MEM_FENCE);"
+    "        }"
+    "        /* text is folded, when it is loaded, so matching compares only bytes */"
+    "        for (i = localId; i < positions + psize - 1; i += localSize) {"
+    "            tile[i] = fold[(unsigned char)input[tileStart + i]];"
+    "        }"
+    "        barrier(CLK_LOCAL_MEM_FENCE);"
+    "        for (i = localId; i < positions; i += localSize) {"
+    "            if (tileMatch(tile + i, localPattern, psize)) {"
+    "                counter++;"
+    "                if (limit) {"
+    "                    atomic_inc(&stop[1]);"
+    "                }"
+    "            }"
+    "        }"
+    "    }"
+    "    output[get_global_id(0)] = counter;"
+    "}"
+    "__kernel void tiled(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi, unsigned long psize, unsigned long inputSize, __global unsigned char* fold, __global unsigned long* offsets, unsigned long tileSize, __local char* tile, __local char* localPattern, __local unsigned int* ranks)"
+    "{"
+    "    unsigned long localId = get_local_id(0);"
+    "    unsigned long localSize = get_local_size(0);"
+    "    unsigned long groups = get_num_groups(0);"
+    "    unsigned long partSize = inputSize / groups;"
+    "    unsigned long written = 0;"
+    "    unsigned long i, start, end, tileStart, positions, round, step;"
+    "    unsigned int rank;"
+    "    int found;"
+    "    if (inputSize < psize) {"
+    "        return;"
+    "    }"
+    "    if (partSize < psize) {"
+    "        partSize = psize;"
+    "    }"
+    "    start = get_group_id(0) * partSize;"
+    "    end = start + partSize;"
+    "    if (get_group_id(0) == groups - 1 || end > inputSize - psize + 1) {"
+    "        end = inputSize - psize + 1;"
+    "    }"
+    "    /* matches of group start at offset of its first work item */"
+    "    output += offsets[get_group_id(0) * localSize];"
+    "    for (i = localId; i < psize; i += localSize) {"
+    "        localPattern[i] = pattern[i];"
+    "    }"
+    "    for (tileStart = start; tileStart < end; tileStart += tileSize) {"
+    "        positions = end - tileStart < tileSize ? end - tileStart : tileSize;"
+    "        barrier(CLK_LOCAL_MEM_FENCE);"
+    "        /* text is folded, when it is loaded, so matching compares only bytes */"
+    "        for (i = localId; i < positions + psize - 1; i += localSize) {"
+    "            tile[i] = fold[(unsigned char)input[tileStart + i]];"
+    "        }"
+    "        barrier(CLK_LOCAL_MEM_FENCE);"
+    "        /* in every round work items check neighbouring positions, scan of found matches gives their order in output */"
+    "        for (round = 0; round < positions; round += localSize) {"
+    "            i = round + localId;"
+    "            found = i < positions && tileMatch(tile + i, localPattern, psize);"
+    "            ranks[localId] = found;"
+    "            barrier(CLK_LOCAL_MEM_FENCE);"
+    "            for (step = 1; step < localSize; step *= 2) {"
+    "                rank = localId >= step ? ranks[localId - step] : 0;"
+    "                barrier(CLK_LOCAL_MEM_FENCE);"
+    "                ranks[localId] += rank;"
+    "                barrier(CLK_LOCAL_MEM_FENCE);"
+    "            }"
+    "            if (found) {"
+    "                output[written + ranks[localId] - 1] = tileStart + i;"
+    "            }"
+    "            written += ranks[localSize - 1];"
+    "            barrier(CLK_LOCAL_MEM_FENCE);"
+    "        }"
     "    }"
     "}";
+
+/**
+ Function adds data to 64-bit FNV-1a hash and returns new hash.
+ */
+static unsigned long long fnv1a(unsigned long long hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ Function returns path of cached file for device or NULL, when there is no cache directory. Program binary and plans of search depend on device, its driver and source of kernels, so all of them are hashed into name of file. Cache directory is APS_CACHE_DIR, or aps in XDG_CACHE_HOME or in ~/.cache. Empty APS_CACHE_DIR turns cache off. Returned path has to be freed.
+ device_id  - cl_device_id
+ extension  - extension of file, bin for program binary, plan for plans
+ */
+static char *openCLCachePath(cl_device_id device_id, const char *extension) {
+    cl_device_info keys[] = {CL_DEVICE_VENDOR, CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    char info[1024];
+    char directory[1024];
+    const char *base;
+    
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        size_t size = 0;
+        if (clGetDeviceInfo(device_id, keys[k], sizeof(info), info, &size) != CL_SUCCESS) {
+            return NULL;
+        }
+        hash = fnv1a(hash, info, size < sizeof(info) ? size : sizeof(info));
+    }
+    hash = fnv1a(hash, source_str, strlen(source_str));
+    
+    if ((base = getenv("APS_CACHE_DIR"))) {
+        if (!*base) {
+            return NULL;
+        }
+        snprintf(directory, sizeof(directory), "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+        snprintf(directory, sizeof(directory), "%s/aps", base);
+    } else if ((base = getenv("HOME")) && *base) {
+        snprintf(directory, sizeof(directory), "%s/.cache", base);
+        mkdir(directory, 0755);
+        snprintf(directory, sizeof(directory), "%s/.cache/aps", base);
+    } else {
+        return NULL;
+    }
+    mkdir(directory, 0755);
+    
+    char *path = malloc(strlen(directory) + strlen(extension) + 32);
+    if (path) {
+        sprintf(path, "%s/%016llx.%s", directory, hash, extension);
+    }
+    return path;
+}
+
+/**
+ Function creates program from cached binary. Returns NULL, when there is no usable binary, then program has to be built from source.
+ */
+static cl_program programCacheLoad(cl_context context, cl_device_id device_id, const char *path) {
+    FILE *file = fopen(path, "rb");
+    struct stat sbuf;
+    cl_program program = NULL;
+    cl_int status, err;
+    
+    if (!file) {
+        return NULL;
+    }
+    if (fstat(fileno(file), &sbuf) == 0 && sbuf.st_size > 0) {
+        size_t size = sbuf.st_size;
+        unsigned char *binary = malloc(size);
+        if (binary && fread(binary, 1, size, file) == size) {
+            program = clCreateProgramWithBinary(context, 1, &device_id, &size, (const unsigned char **)&binary, &status, &err);
+            if (program && (err != CL_SUCCESS || status != CL_SUCCESS || clBuildProgram(program, 0, NULL, NULL, NULL, NULL) != CL_SUCCESS)) {
+                clReleaseProgram(program);
+                program = NULL;
+            }
+        }
+        free(binary);
+    }
+    fclose(file);
+    return program;
+}
+
+/**
+ Function writes binary of built program into cache. File is written under temporary name and renamed, so other process never reads half of it.
+ */
+static void programCacheStore(cl_program program, const char *path) {
+    size_t size = 0;
+    unsigned char *binary;
+    
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0) {
+        return;
+    }
+    binary = malloc(size);
+    if (!binary) {
+        return;
+    }
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS) {
+        char *temporary = malloc(strlen(path) + 32);
+        if (temporary) {
+            sprintf(temporary, "%s.%d", path, (int)getpid());
+            FILE *file = fopen(temporary, "wb");
+            if (file) {
+                int written = fwrite(binary, 1, size, file) == size;
+                if (fclose(file) == 0 && written) {
+                    rename(temporary, path);
+                } else {
+                    unlink(temporary);
+                }
+            }
+            free(temporary);
+        }
+    }
+    free(binary);
+}
+
+/**
+ Function connects to compute device, creates context, queue and kernels. Program is loaded from cache of binaries, when it is there, otherwise it is built from source_str and stored into cache. Returns 0 on success.
+ */
+static int openCLRuntimeInit(openCLRuntime *runtime) {
     int err;
+    cl_uint globalSize;
+    
+    memset(runtime, 0, sizeof(openCLRuntime));
+    
+    // Connect to a compute device
+    //
+    err = clGetDeviceIDs(NULL, CL_DEVICE_TYPE_CPU, 1, &runtime->device_id, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create a device group!\n");
+        return -1;
+    }
+    
+    
+    
+    
+    // Create a compute context
+    //
+    runtime->context = clCreateContext(0, 1, &runtime->device_id, NULL, NULL, &err);
+    if (!runtime->context)
+    {
+        printf("Error: Failed to create a compute context!\n");
+        return -1;
+    }
+    
+    err = clGetDeviceInfo(runtime->device_id, CL_DEVICE_ADDRESS_BITS, sizeof(globalSize), &globalSize, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve device info! %d\n", err);
+        return -1;
+    }
+    
+    size_t maxWorkGroupSize;
+    err = clGetDeviceInfo(runtime->device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve device info! %d\n", err);
+        return -1;
+    }
+    
+    
+    err = clGetDeviceInfo(runtime->device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(runtime->maxMemAlloc), &runtime->maxMemAlloc, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve device info! %d\n", err);
+        return -1;
+    }
+    
+    
+    // Create a command commands
+    //
+    runtime->commands = clCreateCommandQueue(runtime->context, runtime->device_id, 0, &err);
+    if (!runtime->commands)
+    {
+        printf("Error: Failed to create a command commands!\n");
+        return -1;
+    }
+    
+    // Load the compute program from cache or create it from the source buffer
+    //
+    char *cachePath = openCLCachePath(runtime->device_id, "bin");
+    if (cachePath) {
+        runtime->program = programCacheLoad(runtime->context, runtime->device_id, cachePath);
+        runtime->cached = runtime->program != NULL;
+    }
+    if (!runtime->program) {
+        runtime->program = clCreateProgramWithSource(runtime->context, 1, (const char **) & source_str, NULL, &err);
+        if (!runtime->program)
+        {
+            printf("Error: Failed to create compute program!\n");
+            free(cachePath);
+            return -1;
+        }
+        
+        // Build the program executable
+        //
+        err = clBuildProgram(runtime->program, 0, NULL, NULL, NULL, NULL);
+        if (err != CL_SUCCESS)
+        {
+            size_t len;
+            char buffer[2048];
+            
+            printf("Error: Failed to build program executable!\n");
+            clGetProgramBuildInfo(runtime->program, runtime->device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+            printf("%s\n", buffer);
+            free(cachePath);
+            return -1;
+        }
+        if (cachePath) {
+            programCacheStore(runtime->program, cachePath);
+        }
+    }
+    free(cachePath);
+    
+    
+    // Create the compute kernels in the program, runCount and scan for count pass, run for write pass and their tiled variants
+    runtime->run = clCreateKernel(runtime->program, "run", &err);
+    if (!runtime->run || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel!\n");
+        return -1;
+    }
+    runtime->runCount = clCreateKernel(runtime->program, "runCount", &err);
+    if (!runtime->runCount || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel!\n");
+        return -1;
+    }
+    runtime->scan = clCreateKernel(runtime->program, "scan", &err);
+    if (!runtime->scan || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel!\n");
+        return -1;
+    }
+    runtime->tiledCount = clCreateKernel(runtime->program, "tiledCount", &err);
+    if (!runtime->tiledCount || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel!\n");
+        return -1;
+    }
+    runtime->tiled = clCreateKernel(runtime->program, "tiled", &err);
+    if (!runtime->tiled || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel!\n");
+        return -1;
+    }
+    
+    // Get the maximum work group size for executing the tiled kernels on the device, devices which cannot run them in groups get 1
+    //
+    size_t countGroupSize;
+    err = clGetKernelWorkGroupInfo(runtime->tiledCount, runtime->device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(countGroupSize), &countGroupSize, NULL);
+    err |= clGetKernelWorkGroupInfo(runtime->tiled, runtime->device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(runtime->groupSize), &runtime->groupSize, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve kernel work group info! %d\n", err);
+        return -1;
+    }
+    if (countGroupSize < runtime->groupSize) {
+        runtime->groupSize = countGroupSize;
+    }
+    
+    err = clGetKernelWorkGroupInfo(runtime->runCount, runtime->device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(runtime->groupMultiple), &runtime->groupMultiple, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve kernel work group info! %d\n", err);
+        return -1;
+    }
+    
+    err = clGetDeviceInfo(runtime->device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(runtime->localMemSize), &runtime->localMemSize, NULL);
+    err |= clGetDeviceInfo(runtime->device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(runtime->computeUnits), &runtime->computeUnits, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to retrieve device info! %d\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ Function releases OpenCL runtime.
+ */
+static void openCLRuntimeFree(openCLRuntime *runtime) {
+    if (!runtime->context) {
+        return;
+    }
+    if (runtime->run) {
+        clReleaseKernel(runtime->run);
+    }
+    if (runtime->runCount) {
+        clReleaseKernel(runtime->runCount);
+    }
+    if (runtime->scan) {
+        clReleaseKernel(runtime->scan);
+    }
+    if (runtime->tiledCount) {
+        clReleaseKernel(runtime->tiledCount);
+    }
+    if (runtime->tiled) {
+        clReleaseKernel(runtime->tiled);
+    }
+    if (runtime->program) {
+        clReleaseProgram(runtime->program);
+    }
+    if (runtime->commands) {
+        clReleaseCommandQueue(runtime->commands);
+    }
+    clReleaseContext(runtime->context);
+    memset(runtime, 0, sizeof(openCLRuntime));
+}
+
+/**
+ Function returns class of pattern for plans. Short patterns match often and their threads do little work for every match, so they need other plan than long ones.
+ */
+static int openCLPatternClass(unsigned long pattern_size) {
+    if (pattern_size < 4) {
+        return 0;
+    }
+    return pattern_size < 16 ? 1 : 2;
+}
+
+/**
+ Function returns number of positions in one tile of tiled kernels for pattern or 0, when tile does not fit into local memory. Tiled kernels need tile with overlap, pattern and ranks of work-group in local memory, tile is made smaller when it does not fit.
+ */
+static unsigned long openCLTileSize(const openCLRuntime *runtime, size_t local, unsigned long pattern_size) {
+    unsigned long tileSize = OPENCL_TILE_SIZE;
+    unsigned long fixedSize = 2 * pattern_size + local * sizeof(cl_uint);
+    
+    if (fixedSize + tileSize > runtime->localMemSize) {
+        tileSize = runtime->localMemSize > fixedSize ? runtime->localMemSize - fixedSize : 0;
+    }
+    return tileSize < local ? 0 : tileSize;
+}
+
+/**
+ Function reads plans from cache file of device into plans. Every line of file is one plan: class of pattern, global and local size.
+ */
+static void openCLPlanLoad(const openCLRuntime *runtime, openCLPlan *plans) {
+    char *path = openCLCachePath(runtime->device_id, "plan");
+    FILE *file = path ? fopen(path, "r") : NULL;
+    int patternClass;
+    unsigned long global, local;
+    
+    if (file) {
+        while (fscanf(file, "%d %lu %lu", &patternClass, &global, &local) == 3) {
+            if (patternClass >= 0 && patternClass < OPENCL_PATTERN_CLASSES && global > 0 && global <= OPENCL_MAX_THREADS && (local == 0 || global % local == 0)) {
+                plans[patternClass].global = global;
+                plans[patternClass].local = local;
+                plans[patternClass].calibrated = 1;
+            }
+        }
+        fclose(file);
+    }
+    free(path);
+}
+
+/**
+ Function writes calibrated plans into cache file of device. File is written under temporary name and renamed like program binary.
+ */
+static void openCLPlanStore(const openCLRuntime *runtime, const openCLPlan *plans) {
+    char *path = openCLCachePath(runtime->device_id, "plan");
+    if (!path) {
+        return;
+    }
+    char *temporary = malloc(strlen(path) + 32);
+    if (temporary) {
+        sprintf(temporary, "%s.%d", path, (int)getpid());
+        FILE *file = fopen(temporary, "w");
+        if (file) {
+            for (int c = 0; c < OPENCL_PATTERN_CLASSES; c++) {
+                if (plans[c].calibrated) {
+                    fprintf(file, "%d %lu %lu\n", c, (unsigned long)plans[c].global, (unsigned long)plans[c].local);
+                }
+            }
+            if (fclose(file) == 0) {
+                rename(temporary, path);
+            } else {
+                unlink(temporary);
+            }
+        }
+        free(temporary);
+    }
+    free(path);
+}
+
+/**
+ Function measures count pass of plan over sample of haystack. Returns time in seconds, negative when device cannot run plan.
+ */
+static double openCLPlanMeasure(const openCLRuntime *runtime, char *sample, unsigned long sampleSize, unsigned long pattern_size, cl_mem counts, const openCLPlan *plan) {
+    struct timespec begin, end;
+    openCLWindow window;
+    char error[APS_ERROR_SIZE];
+    
+    window.start = 0;
+    window.size = sampleSize;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (openCLWindowCount(runtime, sample, pattern_size, &window, counts, plan, error)) {
+        return -1;
+    }
+    clWaitForEvents(1, &window.counted);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clReleaseEvent(window.counted);
+    clReleaseMemObject(window.input);
+    return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+/**
+ Function chooses plan by calibration. Count pass is run over beginning of haystack with global sizes from number of compute units times preferred multiple of work-group size up to OPENCL_MAX_THREADS, for run kernels and for tiled kernels when device can run them. The fastest one is the plan. When device fails, plan is not calibrated, so default plan is used.
+ */
+static openCLPlan openCLPlanCalibrate(const openCLRuntime *runtime, const searchPattern *compiled, char *text_source, unsigned long text_source_size) {
+    unsigned long pattern_size = compiled->pattern_size;
+    unsigned long sampleSize = text_source_size < OPENCL_CALIBRATION_SIZE ? text_source_size : OPENCL_CALIBRATION_SIZE;
+    size_t base = (runtime->computeUnits ? runtime->computeUnits : 1) * (runtime->groupMultiple ? runtime->groupMultiple : 1);
+    openCLPlan best, plan;
+    double bestTime = 0;
+    int err = 0;
+    
+    memset(&best, 0, sizeof(openCLPlan));
+    cl_mem patternMem = clCreateBuffer(runtime->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(char) * pattern_size, compiled->pattern, &err);
+    cl_mem computePatternMem = clCreateBuffer(runtime->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(int) * pattern_size, compiled->pi, &err);
+    cl_mem foldMem = clCreateBuffer(runtime->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(compiled->fold), (void *)compiled->fold, &err);
+    cl_mem counts = clCreateBuffer(runtime->context, CL_MEM_READ_WRITE, (OPENCL_MAX_THREADS + 1) * sizeof(unsigned long), NULL, &err);
+    // calibration counts all matches of sample
+    cl_uint stop[2] = {0, 0};
+    cl_mem stopMem = clCreateBuffer(runtime->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(stop), stop, &err);
+    cl_kernel kernels[] = {runtime->runCount, runtime->tiledCount};
+    if (!patternMem || !computePatternMem || !foldMem || !counts || !stopMem) {
+        goto cleanup;
+    }
+    for (int k = 0; k < 2; k++) {
+        err |= clSetKernelArg(kernels[k], 2, sizeof(cl_mem), &patternMem);
+        err |= clSetKernelArg(kernels[k], 3, sizeof(cl_mem), &computePatternMem);
+        err |= clSetKernelArg(kernels[k], 4, sizeof(unsigned long), &pattern_size);
+        err |= clSetKernelArg(kernels[k], 6, sizeof(cl_mem), &foldMem);
+    }
+    err |= clSetKernelArg(runtime->runCount, 7, sizeof(cl_mem), &stopMem);
+    err |= clSetKernelArg(runtime->tiledCount, 10, sizeof(cl_mem), &stopMem);
+    if (err != CL_SUCCESS)
+    {
+        goto cleanup;
+    }
+    
+    for (int tiled = 0; tiled < 2; tiled++) {
+        memset(&plan, 0, sizeof(openCLPlan));
+        plan.calibrated = 1;
+        if (tiled) {
+            if (runtime->groupSize < OPENCL_MIN_GROUP_SIZE) {
+                break;
+            }
+            plan.local = runtime->groupSize < OPENCL_GROUP_SIZE ? runtime->groupSize : OPENCL_GROUP_SIZE;
+            plan.tileSize = openCLTileSize(runtime, plan.local, pattern_size);
+            if (!plan.tileSize) {
+                break;
+            }
+        }
+        size_t step = tiled ? plan.local : 1;
+        size_t last = 0;
+        for (size_t global = base; global <= OPENCL_MAX_THREADS; global *= 2) {
+            // global size of tiled kernels is multiple of work-group, more threads than positions are useless
+            plan.global = (global + step - 1) / step * step;
+            if (plan.global == last || plan.global > OPENCL_MAX_THREADS || plan.global > sampleSize / pattern_size) {
+                continue;
+            }
+            last = plan.global;
+            if (bestTime == 0) {
+                // the first run prepares device and pages of sample, so it is not measured
+                openCLPlanMeasure(runtime, text_source, sampleSize, pattern_size, counts, &plan);
+            }
+            double time = openCLPlanMeasure(runtime, text_source, sampleSize, pattern_size, counts, &plan);
+            if (time < 0) {
+                continue;
+            }
+            if (best.global == 0 || time < bestTime) {
+                best = plan;
+                bestTime = time;
+            }
+        }
+    }
+    
+cleanup:
+    if (counts) {
+        clReleaseMemObject(counts);
+    }
+    if (patternMem) {
+        clReleaseMemObject(patternMem);
+    }
+    if (computePatternMem) {
+        clReleaseMemObject(computePatternMem);
+    }
+    if (foldMem) {
+        clReleaseMemObject(foldMem);
+    }
+    if (stopMem) {
+        clReleaseMemObject(stopMem);
+    }
+    return best;
+}
+
+/**
+ Function returns plan of search for pattern. Plan is taken from runtime, then from cache file of device and at last it is calibrated on haystack and stored into cache. Haystack smaller than OPENCL_CALIBRATION_SIZE is not worth calibration, it gets default plan with OPTIMAL_NUMBER_OF_THREADS.
+ runtime            - OpenCL runtime from openCLRuntimeInit
+ compiled           - compiled pattern
+ text_source        - haystack array of characters
+ text_source_size   - length of text_source
+ */
+static openCLPlan openCLRuntimePlan(openCLRuntime *runtime, const searchPattern *compiled, char *text_source, unsigned long text_source_size) {
+    int patternClass = openCLPatternClass(compiled->pattern_size);
+    openCLPlan plan;
+    
+    if (!runtime->plans[patternClass].calibrated) {
+        openCLPlanLoad(runtime, runtime->plans);
+    }
+    if (!runtime->plans[patternClass].calibrated && text_source_size >= OPENCL_CALIBRATION_SIZE) {
+        plan = openCLPlanCalibrate(runtime, compiled, text_source, text_source_size);
+        if (plan.calibrated) {
+            runtime->plans[patternClass] = plan;
+            openCLPlanStore(runtime, runtime->plans);
+        }
+    }
+    plan = runtime->plans[patternClass];
+    if (!plan.calibrated) {
+        plan.global = OPTIMAL_NUMBER_OF_THREADS;
+        plan.local = runtime->groupSize >= OPENCL_MIN_GROUP_SIZE ? (runtime->groupSize < OPENCL_GROUP_SIZE ? runtime->groupSize : OPENCL_GROUP_SIZE) : 0;
+    }
+    // plan is shared by class, but tile depends on length of pattern
+    plan.tileSize = plan.local ? openCLTileSize(runtime, plan.local, compiled->pattern_size) : 0;
+    if (!plan.tileSize) {
+        plan.local = 0;
+    }
+    return plan;
+}
+
+/**
+ Function adds string to list of strings, like patterns or names of files. Returns 0 on success.
+ strings            - list of strings, it is reallocated
+ numberOfStrings    - length of strings
+ string             - string which is added, it is not copied
+ */
+static int addString(char ***strings, unsigned long *numberOfStrings, char *string) {
+    char **resized = realloc(*strings, (*numberOfStrings + 1) * sizeof(char *));
+    if (!resized) {
+        return -1;
+    }
+    resized[*numberOfStrings] = string;
+    *strings = resized;
+    (*numberOfStrings)++;
+    return 0;
+}
+
+/**
+ Function loads patterns from file, one pattern on every line. Empty lines are skipped. Returns content of file, which patterns point into, or NULL on error.
+ patternFileName    - file with patterns
+ patterns           - list of patterns, it is reallocated
+ numberOfPatterns   - length of patterns
+ */
+static char *loadPatternFile(const char *patternFileName, char ***patterns, unsigned long *numberOfPatterns) {
+    FILE *file = fopen(patternFileName, "r");
+    char *content = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    size_t read;
+    
+    if (!file) {
+        return NULL;
+    }
+    do {
+        if (length + 1 >= capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            char *resized = realloc(content, capacity);
+            if (!resized) {
+                free(content);
+                fclose(file);
+                return NULL;
+            }
+            content = resized;
+        }
+        read = fread(content + length, 1, capacity - length - 1, file);
+        length += read;
+    } while (read > 0);
+    fclose(file);
+    content[length] = '\0';
+    
+    char *line = content;
+    while (line < content + length) {
+        char *end = memchr(line, NEWLINE, content + length - line);
+        if (!end) {
+            end = content + length;
+        }
+        *end = '\0';
+        if (end > line && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+        if (*line && addString(patterns, numberOfPatterns, line)) {
+            free(content);
+            return NULL;
+        }
+        line = end + 1;
+    }
+    return content;
+}
+
+/**
+ Function runs one search given by command line arguments and prints its results. It is called once by main, or for every query in serve mode.
+ argc, argv  - arguments like for main
+ runtime     - OpenCL runtime kept between searches, it is prepared on first search with -t. With NULL search is not served, runtime is prepared only for this search and stdin can be searched
+ */
+static int runSearch(int argc, char** argv, openCLRuntime *runtime)
+{
+    char *textmemblock = NULL;
+    
+    char **fileNames = NULL;            // files and directories from -f
+    unsigned long numberOfFileNames = 0;
+    
+    int fd = -1;
+    struct stat sbuf;
+
+    char **patterns = NULL;             // needles from -p and -P
+    unsigned long numberOfPatterns = 0;
+    char *patternFile = NULL;           // content of -P files, patterns point into it
+    
+    openCLRuntime ownRuntime;           // runtime of search, which is not served
+    
+    size_t text_source_size = 0;
+    int multithreading = 0;
+    int nativeThreading = 0;
+    size_t numOfWorkers = 0;
+    int linesOption = 0;
+    unsigned long before = 0;           // lines of context from -B and -C
+    unsigned long after = 0;            // lines of context from -A and -C
+    int offsetOption = 0;
+    int countOption = 0;
+    unsigned long maxFinds = 0;         // limit of matches from -m, 0 for no limit
+    int quietOption = 0;
+    char *algorithm = NULL;
+    int patternOptions = 0;             // PATTERN_IGNORE_CASE, PATTERN_WILDCARDS and PATTERN_EDITS
+    unsigned long errors = 0;           // allowed errors from -k or -K
+    int io = IO_MMAP;                   // strategy of loading files from -I
+    streamFollow follow = {NULL, NULL}; // file of --follow and its --checkpoint
+    int followOption = 0;
+    int debugOption = 0;
+    apsPattern *pattern = NULL;
+    int status = EXIT_FAILURE;          // exit status, every return after parsing goes through cleanup
+    int i = 1;
+    
+    while (i < argc) {
+        if (!strcmp(argv[i], "-p")) {
+            if (i + 1 >= argc) {
+                printf("no pattern defined!\n");
+                goto cleanup;
+            }
+            if (addString(&patterns, &numberOfPatterns, argv[i+1])) {
+                printf("Error: Failed to allocate memory for pattern!\n");
+                goto cleanup;
+            }
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-P")) {
+            if (i + 1 >= argc) {
+                printf("no pattern file defined!\n");
+                goto cleanup;
+            }
+            if (patternFile) {
+                printf("use -P only once!\n");
+                goto cleanup;
+            }
+            patternFile = loadPatternFile(argv[i+1], &patterns, &numberOfPatterns);
+            if (!patternFile) {
+                fprintf(stderr, "Error opening pattern file\n");
+                goto cleanup;
+            }
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-f")) {
+            if (i + 1 >= argc) {
+                printf("no file defined!\n");
+                goto cleanup;
+            }
+            if (addString(&fileNames, &numberOfFileNames, argv[i+1])) {
+                printf("Error: Failed to allocate memory for files!\n");
+                goto cleanup;
+            }
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-h")) {
+            printf("aps [-tlocdigq] [-j workers] [-a algorithm] [-k errors] [-K errors] [-m matches] [-A lines] [-B lines] [-C lines] [-I strategy] [--follow [--checkpoint file]] [-p pattern]... [-P pattern file] [-f file]...\naps -s\naps index file...\naps bench [options]\n\t-s\tserve mode, every line of stdin is one query with options above, results end with line \".\"\n\tindex\tmakes trigram index of files, searches of file with index read only blocks, where pattern can be\n\tbench\tmeasures all engines over synthetic corpus, aps bench -h lists its options\n\t-t\tmultithreading with OpenCL\n\t-j\tmultithreading with native threads, 0 means one worker per processor, with -t they search together with OpenCL device\n\t-a\talgorithm kmp, bmh, twoway, ahocorasick, shiftor or auto (default)\n\t-i\tignores case of ASCII letters\n\t-g\t? in pattern matches any byte, only one pattern without -t\n\t-k\tallowed mismatched bytes, only one pattern of at most 64 bytes without -t\n\t-K\tallowed edits (mismatched, inserted or deleted bytes), like -k\n\t-l\touputs number of line and line itself\n\t-A\tlines of context after line with match, with -B before it, with -C both\n\t-o\toutputs offset in bytes (and number of pattern for more patterns)\n\t-c\toutputs only number of matches (default without -l and -o)\n\t-m\tstops after given number of matches (in every file)\n\t-q\toutputs nothing, exit status is 0 only when there is match, search stops at the first one\n\t-I\tI/O strategy mmap (default), sequential, huge, populate, read or direct\n\t--follow\tsearches file and then bytes appended to it like tail -f, it implies -l without -o\n\t--checkpoint\tfile with state of --follow, search started again continues, where it stopped\n\t-d\touputs debug at the end as JSON (phases, workers, counters)\n\t-p\tpattern, it can be repeated\n\t-P\tfile with one pattern on every line\n\t-f\tfile or directory, it can be repeated, without it or with - stdin is searched\n");
+            status = EXIT_SUCCESS;
+            goto cleanup;
+        }else if (!strcmp(argv[i], "-t")) {
+            multithreading = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-j")) {
+            if (i + 1 >= argc) {
+                printf("no number of workers defined!\n");
+                goto cleanup;
+            }
+            numOfWorkers = strtoul(argv[i+1], NULL, 10);
+            nativeThreading = 1;
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-a")) {
+            if (i + 1 >= argc) {
+                printf("no algorithm defined!\n");
+                goto cleanup;
+            }
+            algorithm = argv[i+1];
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-l")) {
+            linesOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-A") || !strcmp(argv[i], "-B") || !strcmp(argv[i], "-C")) {
+            if (i + 1 >= argc) {
+                printf("no number of lines defined!\n");
+                goto cleanup;
+            }
+            unsigned long lines = strtoul(argv[i+1], NULL, 10);
+            if (argv[i][1] != 'B') {
+                after = lines;
+            }
+            if (argv[i][1] != 'A') {
+                before = lines;
+            }
+            // context is printed around lines
+            linesOption = 1;
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-c")) {
+            countOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-m")) {
+            if (i + 1 >= argc) {
+                printf("no number of matches defined!\n");
+                goto cleanup;
+            }
+            maxFinds = strtoul(argv[i+1], NULL, 10);
+            if (maxFinds == 0) {
+                printf("wrong number of matches %s!\n", argv[i+1]);
+                goto cleanup;
+            }
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-q")) {
+            quietOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-o")) {
+            offsetOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-d")){
+            debugOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-i")) {
+            patternOptions |= PATTERN_IGNORE_CASE;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-g")) {
+            patternOptions |= PATTERN_WILDCARDS;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "-K")) {
+            if (i + 1 >= argc) {
+                printf("no number of errors defined!\n");
+                goto cleanup;
+            }
+            errors = strtoul(argv[i+1], NULL, 10);
+            if (!strcmp(argv[i], "-K")) {
+                patternOptions |= PATTERN_EDITS;
+            }
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "--follow")) {
+            followOption = 1;
+            i++;
+            continue;
+        }else if (!strcmp(argv[i], "--checkpoint")) {
+            if (i + 1 >= argc) {
+                printf("no checkpoint file defined!\n");
+                goto cleanup;
+            }
+            follow.checkpointName = argv[i+1];
+            i += 2;
+            continue;
+        }else if (!strcmp(argv[i], "-I")) {
+            if (i + 1 >= argc) {
+                printf("no I/O strategy defined!\n");
+                goto cleanup;
+            }
+            if ((io = ioStrategyFind(argv[i+1])) < 0) {
+                printf("unknown I/O strategy %s!\n", argv[i+1]);
+                goto cleanup;
+            }
+            i += 2;
+            continue;
+        }else {
+            printf("wrong argument %s\n", argv[i]);
+            printf("aps [-tlocdigq] [-j workers] [-a algorithm] [-k errors] [-K errors] [-m matches] [-A lines] [-B lines] [-C lines] [-I strategy] [-p pattern]... [-P pattern file] [-f file]...\nNAME\naps \nDESCRIPTION\nFile pattern searcher. Utility searches any given input files, selecting lines that match one patterns.\n");
+            goto cleanup;
+        }
+    }
+    
+    if (numberOfPatterns == 0) {
+        printf("no pattern defined!\n");
+        goto cleanup;
+    }
+    if (multithreading && numberOfPatterns > 1) {
+        printf("-t searches only one pattern, use -j for more patterns!\n");
+        goto cleanup;
+    }
+    if (quietOption) {
+        // the first match answers, whether there is some, and nothing is written
+        maxFinds = 1;
+        countOption = 1;
+    }
+    // served queries do not inherit strategy of previous query
+    ioStrategy = io;
+    if (followOption) {
+        if (numberOfFileNames != 1 || !strcmp(fileNames[0], "-") || multithreading || runtime) {
+            printf("--follow follows one file given by -f without -t and without serve mode!\n");
+            goto cleanup;
+        }
+        if (countOption && !quietOption) {
+            printf("--follow prints out occurances as they are appended, use -l or -o!\n");
+            goto cleanup;
+        }
+        // like tail -f lines are printed out without -o
+        linesOption = !offsetOption;
+        follow.fileName = fileNames[0];
+    } else if (follow.checkpointName) {
+        printf("--checkpoint is used only with --follow!\n");
+        goto cleanup;
+    }
+    
+    // with -d phases of search are measured from here
+    profileStart(debugOption);
+    unsigned long long begin = profileNow();
+    // command line is client of library, it searches compiled patterns of library with its own drivers
+    char error[APS_ERROR_SIZE];
+    pattern = apsPatternCompile((const char **)patterns, numberOfPatterns, algorithm, patternOptions, errors, error);
+    if (!pattern) {
+        printf("Error: %s\n", error);
+        goto cleanup;
+    }
+    profileAdd(PROFILE_PATTERN, begin);
+    const searchPattern *compiled = &pattern->compiled;
+    if (multithreading && compiled->wildcards) {
+        printf("-t cannot search wildcards, use -j!\n");
+        goto cleanup;
+    }
+    if (multithreading && compiled->errors) {
+        printf("-t searches only exact pattern, use -j for errors!\n");
+        goto cleanup;
+    }
+    
+    // More files or directory are searched by multi-file scheduler, every result is prefixed by name of file
+    if (numberOfFileNames > 1 || (numberOfFileNames == 1 && stat(fileNames[0], &sbuf) == 0 && S_ISDIR(sbuf.st_mode))) {
+        fileList list;
+        unsigned long numberOfFinds = 0;
+        
+        if (multithreading) {
+            printf("-t searches only one file, use -j for more files!\n");
+            goto cleanup;
+        }
+        if (follow.fileName) {
+            printf("--follow follows only regular file!\n");
+            goto cleanup;
+        }
+        memset(&list, 0, sizeof(fileList));
+        begin = profileNow();
+        for (unsigned long f = 0; f < numberOfFileNames; f++) {
+            fileListAdd(&list, fileNames[f], 1);
+        }
+        profileAdd(PROFILE_LOAD, begin);
+        if (!quietOption) {
+            printf("Proccessing ...\n");
+        }
+        size_t numOfThreads = findStringFiles(&list, compiled, linesOption, offsetOption, countOption, before, after, maxFinds, quietOption, nativeThreading ? numOfWorkers : 1, &numberOfFinds);
+        if (quietOption) {
+            // only exit status answers
+        } else if (numberOfFinds > 0) {
+            printf("\nNumber of matches: %lu\n", numberOfFinds);
+        } else {
+            printf("No match in files\n");
+        }
+        if (debugOption) {
+            printf("{\n  \"input_size\": %lu,\n  \"files\": %lu,\n  \"threads\": %lu,\n  \"algorithm\": \"%s\",\n  \"matches\": %lu,\n", list.size, list.numberOfFiles, (unsigned long)numOfThreads, compiled->matcher->name, numberOfFinds);
+            profilePrint();
+        }
+        fileListFree(&list);
+        status = quietOption && numberOfFinds == 0 ? 1 : 0;
+        goto cleanup;
+    }
+    
+    // Without file or with "-" stdin is searched
+    begin = profileNow();
+    if (numberOfFileNames == 0 || !strcmp(fileNames[0], "-")) {
+        if (runtime) {
+            printf("stdin is used for queries in serve mode, use -f!\n");
+            goto cleanup;
+        }
+        fd = STDIN_FILENO;
+    } else if ((fd = open(fileNames[0], O_RDONLY)) == -1) {
+        fprintf(stderr, "Error opening file\n");
+        goto cleanup;
+    }
+    
+    if (fstat(fd, &sbuf) == -1) {
+        fprintf(stderr, "Stat error\n");
+        goto cleanup;
+    }
+    if (!quietOption) {
+        printf("Proccessing ...\n");
+    }
+    
+
+    
+    
+    /* Load text file, streams like pipes and files which cannot be mapped are read block by block */
+    int stream = 1;
+    if (follow.fileName) {
+        // followed file is read from the end of the last search, its size grows
+        if (!S_ISREG(sbuf.st_mode)) {
+            printf("--follow follows only regular file!\n");
+            goto cleanup;
+        }
+    } else if (S_ISREG(sbuf.st_mode) && io >= IO_READ && !multithreading) {
+        // file is read like stream ahead of search, O_DIRECT is not supported by every file system
+#ifdef O_DIRECT
+        if (io == IO_DIRECT && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1 && !quietOption) {
+            printf("O_DIRECT is not supported, file is read through page cache\n");
+        }
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    } else if (S_ISREG(sbuf.st_mode) && sbuf.st_size > 0) {
+        textmemblock = ioMap(fd, sbuf.st_size);
+        if (textmemblock != (caddr_t)(-1)) {
+            text_source_size = sbuf.st_size;
+            stream = 0;
+        } else {
+            textmemblock = NULL;
+        }
+    }
+    profileAdd(PROFILE_LOAD, begin);
+    if (stream && multithreading) {
+        printf("-t cannot search stream, it needs file, which can be mapped!\n");
+        goto cleanup;
+    }
+    
+    // File with index made by aps index is searched only in blocks, where all trigrams of some pattern are, index knows only exact bytes. Stdin has no name, so it has no index
+    searchIndex index;
+    int indexed = 0;
+    unsigned char *candidates = NULL;   // blocks of index, where some pattern can be
+    unsigned long numberOfCandidates = 0;
+    memset(&index, 0, sizeof(searchIndex));
+    if (!stream && !multithreading && compiled->exact && fd != STDIN_FILENO) {
+        int shortPattern = 0;
+        for (unsigned long p = 0; p < numberOfPatterns; p++) {
+            shortPattern |= compiled->patternSizes[p] < 3;
+        }
+        int status = shortPattern ? -1 : searchIndexOpen(&index, fileNames[0], &sbuf);
+        if (status == 1 && !quietOption) {
+            printf("Index of %s is stale, whole file is searched, run aps index again\n", fileNames[0]);
+        }
+        indexed = status == 0 && (candidates = searchIndexSelect(&index, compiled, &numberOfCandidates)) != NULL;
+        // index, which does not skip enough blocks, is slower than workers searching whole file together
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned long workers = !nativeThreading ? 1 : numOfWorkers ? numOfWorkers : (online > 0 ? online : 1);
+        if (indexed && numberOfCandidates * workers > index.header->numberOfBlocks) {
+            indexed = 0;
+        }
+        if (!indexed) {
+            free(candidates);
+            candidates = NULL;
+            searchIndexFree(&index);
+        }
+    }
+    
+    resultSink sink;
+    if (sinkInit(&sink, indexed ? NULL : textmemblock, indexed ? 0 : text_source_size, patterns, numberOfPatterns, linesOption, offsetOption, countOption, numOfWorkers)) {
+        printf("Error: Failed to allocate memory for results!\n");
+        exit(1);
+    }
+    sinkSetContext(&sink, before, after);
+    sinkSetLimit(&sink, maxFinds, quietOption);
+    
+    size_t numOfThreads = 1;
+    int cachedProgram = 0;
+    openCLPlan plan = {0, 0, 0, 0};
+    unsigned long deviceSearched = 0;
+    unsigned long indexSearched = 0;
+    //Original
+    if (stream) {
+        // one thread reads stream and this one or native workers search it
+        numOfThreads = nativeThreading ? numOfWorkers : 1;
+        text_source_size = findStringStream(fd, compiled, &sink, follow.fileName ? &follow : NULL, &numOfThreads);
+    } else if (indexed) {
+        indexSearched = findStringIndexed(textmemblock, text_source_size, &index, candidates, compiled, &sink);
+        searchIndexFree(&index);
+        free(candidates);
+    } else if (nativeThreading && !multithreading) {
+        numOfThreads = findStringNativeThreads(textmemblock, text_source_size, compiled, &sink, numOfWorkers);
+    } else if (!multithreading && io == IO_POPULATE) {
+        // one worker prepares parts one after another
+        numOfThreads = findStringNativeThreads(textmemblock, text_source_size, compiled, &sink, 1);
+    } else if (!multithreading) {
+        findStringSingleThread(textmemblock, text_source_size, compiled, &sink);
+    } else {
+        // OpenCL runtime is prepared only once, served searches share it
+        if (!runtime) {
+            runtime = &ownRuntime;
+            memset(runtime, 0, sizeof(openCLRuntime));
+        }
+        begin = profileNow();
+        if (!runtime->context && openCLRuntimeInit(runtime)) {
+            openCLRuntimeFree(runtime);
+            sinkFree(&sink);
+            goto cleanup;
+        }
+        cachedProgram = runtime->cached;
+        plan = openCLRuntimePlan(runtime, compiled, textmemblock, text_source_size);
+        profileAdd(PROFILE_DEVICE, begin);
+        
+        // with -j host workers search together with device
+        size_t numOfHostWorkers = 0;
+        if (nativeThreading) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            numOfHostWorkers = numOfWorkers ? numOfWorkers : (online > 0 ? online : 1);
+        }
+        char error[APS_ERROR_SIZE];
+        int failed = findStringHybrid(runtime, &plan, textmemblock, text_source_size, compiled, &sink, numOfHostWorkers, &numOfThreads, &deviceSearched, error);
+        
+        if (runtime == &ownRuntime) {
+            openCLRuntimeFree(runtime);
+        }
+        if (failed) {
+            // served query fails alone, cached runtime stays for next queries
+            printf("Error: %s\n", error);
+            sinkFree(&sink);
+            goto cleanup;
+        }
+    }
+    
+
+    unsigned long numberOfFinds = sink.numberOfFinds;
+    sinkFinish(&sink);
+
+    if (debugOption) {
+        // report is one JSON object, so runs can be scraped
+        printf("{\n  \"input_size\": %lu,\n  \"threads\": %lu,\n  \"algorithm\": \"%s\",\n  \"matches\": %lu,\n", text_source_size, (unsigned long)numOfThreads, multithreading ? "kmp" : compiled->matcher->name, numberOfFinds);
+        if (indexed) {
+            printf("  \"index_searched\": %lu,\n", indexSearched);
+        }
+        if (multithreading) {
+            printf("  \"program\": \"%s\",\n", cachedProgram ? "cached binary" : "built from source");
+            printf("  \"plan\": {\"work_items\": %lu, \"tiled\": %s, \"calibrated\": %s},\n", (unsigned long)plan.global, plan.local ? "true" : "false", plan.calibrated ? "true" : "false");
+            printf("  \"device_searched\": %lu,\n", deviceSearched);
+        }
+        profilePrint();
+    }
+    
+    status = quietOption && numberOfFinds == 0 ? 1 : 0;
+    
+    // Shutdown and cleanup, served query, which failed, releases everything too
+    //
+cleanup:
+    profileStart(0);
+    int outputFailure = outputCheck();
+    if (outputFailure) {
+        // like grep, results which were not written are error of whole search
+        fprintf(stderr, "Error writing output: %s\n", strerror(outputFailure));
+        status = EXIT_FAILURE;
+    }
+    apsPatternFree(pattern);
+    free(patterns);
+    free(patternFile);
+    free(fileNames);
+    if (textmemblock) {
+        munmap(textmemblock, text_source_size);
+    }
+    if (fd >= 0 && fd != STDIN_FILENO) {
+        close(fd);
+    }
+    
+    return status;
+}
+
+/**
+ Function splits query into arguments. Arguments are separated by white space, they can be quoted with " or ' and backslash escapes next character. Query is changed in place and arguments point into it.
+ query      - line of query
+ argv       - array for arguments, first one is name of program
+ maxArgs    - size of argv
+ Returns number of arguments, or -1 when there are too many or quote is not closed.
+ */
+static int splitQuery(char *query, char **argv, int maxArgs) {
+    int argc = 0;
+    char *read = query;
+    char *write = query;
+    
+    argv[argc++] = "aps";
+    while (1) {
+        while (*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r') {
+            read++;
+        }
+        if (!*read) {
+            return argc;
+        }
+        if (argc >= maxArgs) {
+            return -1;
+        }
+        argv[argc++] = write;
+        char quote = 0;
+        while (*read && (quote || (*read != ' ' && *read != '\t' && *read != '\n' && *read != '\r'))) {
+            if (*read == '\\' && read[1] && quote != '\'') {
+                read++;
+                *write++ = *read++;
+            } else if (quote && *read == quote) {
+                quote = 0;
+                read++;
+            } else if (!quote && (*read == '"' || *read == '\'')) {
+                quote = *read++;
+            } else {
+                *write++ = *read++;
+            }
+        }
+        if (quote) {
+            return -1;
+        }
+        if (*read) {
+            read++;
+        }
+        *write++ = '\0';
+    }
+}
+
+/**
+ Serve mode reads queries from stdin, one on every line, and answers them until end of input. OpenCL context, queue and built program are kept between queries, so only first query with -t pays for them. Every answer ends with line ".", so client knows when to send next query.
+ */
+static int serve(void) {
+    openCLRuntime runtime;
+    char *query = NULL;
+    size_t querySize = 0;
+    char *args[256];
     
+    memset(&runtime, 0, sizeof(openCLRuntime));
+    while (getline(&query, &querySize, stdin) != -1) {
+        int argc = splitQuery(query, args, sizeof(args) / sizeof(args[0]));
+        if (argc < 0) {
+            printf("wrong query!\n");
+        } else if (argc > 1) {
+            runSearch(argc, args, &runtime);
+        }
+        printf(".\n");
+        fflush(stdout);
+    }
+    free(query);
+    openCLRuntimeFree(&runtime);
+    return 0;
+}
+
+/**
+ Corpus and options of benchmark, see bench.
+ */
+typedef struct {
+    char *text_source;              // synthetic haystack
+    unsigned long text_source_size;
+    unsigned long alphabet;         // number of different bytes of haystack, new lines are added to them
+    unsigned long density;          // implanted occurances of every pattern in MB
+    unsigned long lengths[BENCH_MAX_LENGTHS];   // lengths of patterns
+    unsigned long numberOfLengths;
+    char *patterns[BENCH_MAX_LENGTHS];          // one pattern of every length, implanted into haystack
+    unsigned long runs;             // measured runs of every engine and pattern
+    size_t numOfWorkers;            // native workers, 0 means number of online processors
+    char *fileName;                 // file, where corpus is written for engines with cold page cache (io-*), NULL without them
+    unsigned long long random;      // state of xorshift generator, it starts from BENCH_SEED, so corpus is the same in every run
+} benchCorpus;
+
+/**
+ One line of benchmark report.
+ */
+typedef struct {
+    const char *engine;
+    unsigned long length;           // length of pattern
+    unsigned long matches;
+    double throughput;              // GB/s of median run
+    double p50, p90, p99;           // latency of runs in ms
+    long peakRss;                   // peak resident memory during runs of engine in KB, -1 when it is not known
+} benchResult;
+
+/**
+ Function returns next number of xorshift generator of corpus.
+ */
+static unsigned long long benchRandom(benchCorpus *corpus) {
+    corpus->random ^= corpus->random << 13;
+    corpus->random ^= corpus->random >> 7;
+    corpus->random ^= corpus->random << 17;
+    return corpus->random;
+}
+
+/**
+ Function prepares corpus of size bytes and random pattern of every length. Every pattern has its own generator seeded by its length, so pattern of some length is the same whatever other lengths are measured. Returns 0 on success.
+ */
+static int benchCorpusInit(benchCorpus *corpus, unsigned long size) {
+    corpus->text_source = malloc(size);
+    corpus->text_source_size = size;
+    if (!corpus->text_source) {
+        return -1;
+    }
+    for (unsigned long l = 0; l < corpus->numberOfLengths; l++) {
+        unsigned long length = corpus->lengths[l];
+        if (!(corpus->patterns[l] = malloc(length + 1))) {
+            return -1;
+        }
+        corpus->random = BENCH_SEED ^ length;
+        for (unsigned long i = 0; i < length; i++) {
+            corpus->patterns[l][i] = BENCH_ALPHABET[benchRandom(corpus) % corpus->alphabet];
+        }
+        corpus->patterns[l][length] = '\0';
+    }
+    return 0;
+}
+
+/**
+ Function generates haystack for pattern l: random bytes from first alphabet bytes of BENCH_ALPHABET with new line after about every BENCH_LINE_SIZE bytes, where pattern is implanted density times in every MB at random offsets. Haystack is generated from the same seed for every pattern, so number of matches depends only on size, alphabet, density and pattern.
+ */
+static void benchCorpusFill(benchCorpus *corpus, unsigned long l) {
+    unsigned long size = corpus->text_source_size;
+    unsigned long length = corpus->lengths[l];
     
-    char *textmemblock;
+    corpus->random = BENCH_SEED;
+    for (unsigned long i = 0; i < size; i++) {
+        unsigned long long r = benchRandom(corpus);
+        corpus->text_source[i] = r % BENCH_LINE_SIZE == 0 ? NEWLINE : BENCH_ALPHABET[(r >> 8) % corpus->alphabet];
+    }
+    unsigned long implants = size < length ? 0 : (unsigned long)((double)size / (1024 * 1024) * corpus->density);
+    for (unsigned long n = 0; n < implants; n++) {
+        memcpy(corpus->text_source + benchRandom(corpus) % (size - length + 1), corpus->patterns[l], length);
+    }
+}
+
+/**
+ Function writes haystack into file of corpus for engines with cold page cache. Written pages are synced, so they are clean and they can be dropped from page cache. Returns 0 on success.
+ */
+static int benchCorpusWrite(benchCorpus *corpus) {
+    int fd = open(corpus->fileName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    unsigned long written = 0;
     
-    char textFileName[255];
+    if (fd == -1) {
+        return -1;
+    }
+    while (written < corpus->text_source_size) {
+        ssize_t count = write(fd, corpus->text_source + written, corpus->text_source_size - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            close(fd);
+            return -1;
+        }
+        written += count;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+/**
+ Function drops file of corpus from page cache, so next search reads it from disk. It needs no root like /proc/sys/vm/drop_caches, but kernel can keep some pages.
+ */
+static void benchDropCache(benchCorpus *corpus) {
+    int fd = open(corpus->fileName, O_RDONLY);
     
-    int fd;
-    struct stat sbuf;
+    if (fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+}
 
-    char pattern[255];
+/**
+ Function searches file of corpus with I/O strategy like aps -I and native workers of corpus, read strategies search blocks behind reader.
+ */
+static void benchSearchFile(benchCorpus *corpus, int io, const searchPattern *compiled, resultSink *sink) {
+    int fd = open(corpus->fileName, O_RDONLY);
     
-    size_t local = 0;                   // local domain size for our calculation
-    cl_uint globalSize;
+    if (fd == -1) {
+        return;
+    }
+    ioStrategy = io;
+    if (io >= IO_READ) {
+#ifdef O_DIRECT
+        if (io == IO_DIRECT) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+        }
+#endif
+        size_t numOfWorkers = corpus->numOfWorkers;
+        findStringStream(fd, compiled, sink, NULL, &numOfWorkers);
+    } else {
+        char *text_source = ioMap(fd, corpus->text_source_size);
+        if (text_source != MAP_FAILED) {
+            findStringNativeThreads(text_source, corpus->text_source_size, compiled, sink, corpus->numOfWorkers);
+            munmap(text_source, corpus->text_source_size);
+        }
+    }
+    ioStrategy = IO_MMAP;
+    close(fd);
+}
+
+/**
+ Function releases corpus.
+ */
+static void benchCorpusFree(benchCorpus *corpus) {
+    free(corpus->text_source);
+    for (unsigned long l = 0; l < corpus->numberOfLengths; l++) {
+        free(corpus->patterns[l]);
+    }
+}
+
+/**
+ Function resets peak resident memory of process, so peak of next engine is measured alone. It works only on Linux, elsewhere peak of whole process is reported.
+ */
+static void benchResetPeak(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0) {
+            // peak stays from start of process
+        }
+        close(fd);
+    }
+}
+
+/**
+ Function returns peak resident memory of process in KB, -1 when it is not known.
+ */
+static long benchPeakRss(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = -1;
     
-    cl_device_id device_id;             // compute device id
-    cl_context context;                 // compute context
-    cl_command_queue commands;          // compute command queue
-    cl_program program;                 // compute program
-    cl_kernel kernel;                   // compute kernel
+    if (status) {
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) {
+                break;
+            }
+        }
+        fclose(status);
+    }
+    if (peak < 0) {
+        struct rusage usage;
+        if (!getrusage(RUSAGE_SELF, &usage)) {
+            // macOS reports bytes, Linux KB
+#ifdef __APPLE__
+            peak = usage.ru_maxrss / 1024;
+#else
+            peak = usage.ru_maxrss;
+#endif
+        }
+    }
+    return peak;
+}
+
+/**
+ Function compares two times of runs for qsort.
+ */
+static int benchCompareTimes(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ Function returns percentile of sorted times by nearest rank.
+ */
+static double benchPercentile(const double *times, unsigned long runs, unsigned long percent) {
+    unsigned long rank = (percent * runs + 99) / 100;
+    return times[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ Function runs one engine over corpus with pattern of one length in count mode. One run warms up pages and caches, then runs are measured. Returns 0 on success.
+ corpus     - corpus from benchCorpusInit
+ engine     - kmp, bmh, twoway, ahocorasick or shiftor for single thread, threads for native threads, opencl for device alone and hybrid for device with native workers
+ l          - index of pattern in corpus
+ runtime    - OpenCL runtime for opencl and hybrid, NULL otherwise
+ result     - line of report, which is filled in
+ */
+static int benchEngine(benchCorpus *corpus, const char *engine, unsigned long l, openCLRuntime *runtime, benchResult *result) {
+    searchPattern compiled;
+    double times[BENCH_MAX_RUNS];
+    int threads = !strcmp(engine, "threads");
+    // engines io-* search file with cold page cache
+    int io = strncmp(engine, "io-", 3) ? -1 : ioStrategyFind(engine + 3);
+    const char *algorithm = runtime || threads || io >= 0 ? NULL : engine;
+    size_t numOfHostWorkers = 0;
+    openCLPlan plan;
     
+    if (searchPatternInit(&compiled, &corpus->patterns[l], 1, algorithm, 0, 0)) {
+        printf("Error: %s\n", compiled.error);
+        return -1;
+    }
+    if (runtime) {
+        plan = openCLRuntimePlan(runtime, &compiled, corpus->text_source, corpus->text_source_size);
+        if (!strcmp(engine, "hybrid")) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            numOfHostWorkers = corpus->numOfWorkers ? corpus->numOfWorkers : (online > 0 ? online : 1);
+        }
+    }
     
+    benchResetPeak();
+    for (unsigned long run = 0; run <= corpus->runs; run++) {
+        struct timespec begin, end;
+        resultSink sink;
+        unsigned long deviceSearched;
+        
+        if (sinkInit(&sink, corpus->text_source, corpus->text_source_size, &corpus->patterns[l], 1, 0, 0, 1, corpus->numOfWorkers)) {
+            printf("Error: Failed to allocate memory for results!\n");
+            exit(1);
+        }
+        sinkSetLimit(&sink, 0, 1);
+        if (io >= 0) {
+            benchDropCache(corpus);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (io >= 0) {
+            benchSearchFile(corpus, io, &compiled, &sink);
+        } else if (runtime) {
+            size_t numOfThreads;
+            char error[APS_ERROR_SIZE];
+            if (findStringHybrid(runtime, &plan, corpus->text_source, corpus->text_source_size, &compiled, &sink, numOfHostWorkers, &numOfThreads, &deviceSearched, error)) {
+                printf("Error: %s\n", error);
+                exit(1);
+            }
+        } else if (threads) {
+            findStringNativeThreads(corpus->text_source, corpus->text_source_size, &compiled, &sink, corpus->numOfWorkers);
+        } else {
+            findStringSingleThread(corpus->text_source, corpus->text_source_size, &compiled, &sink);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        result->matches = sink.numberOfFinds;
+        sinkFinish(&sink);
+        // the first run only warms up
+        if (run > 0) {
+            times[run - 1] = ((end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9) * 1000;
+        }
+    }
+    result->peakRss = benchPeakRss();
+    searchPatternFree(&compiled);
     
+    qsort(times, corpus->runs, sizeof(double), benchCompareTimes);
+    result->engine = engine;
+    result->length = corpus->lengths[l];
+    result->p50 = benchPercentile(times, corpus->runs, 50);
+    result->p90 = benchPercentile(times, corpus->runs, 90);
+    result->p99 = benchPercentile(times, corpus->runs, 99);
+    result->throughput = result->p50 > 0 ? corpus->text_source_size / (result->p50 / 1000) / 1e9 : 0;
+    return 0;
+}
+
+/**
+ Function writes report of benchmark as CSV with header or as JSON array.
+ */
+static void benchReport(FILE *file, const benchCorpus *corpus, const benchResult *results, unsigned long numberOfResults, int json) {
+    if (json) {
+        fprintf(file, "[\n");
+    } else {
+        fprintf(file, "engine,pattern_length,size,alphabet,density,matches,gbps,p50_ms,p90_ms,p99_ms,peak_rss_kb\n");
+    }
+    for (unsigned long r = 0; r < numberOfResults; r++) {
+        const benchResult *result = &results[r];
+        if (json) {
+            fprintf(file, "  {\"engine\": \"%s\", \"pattern_length\": %lu, \"size\": %lu, \"alphabet\": %lu, \"density\": %lu, \"matches\": %lu, \"gbps\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"peak_rss_kb\": %ld}%s\n", result->engine, result->length, corpus->text_source_size, corpus->alphabet, corpus->density, result->matches, result->throughput, result->p50, result->p90, result->p99, result->peakRss, r + 1 < numberOfResults ? "," : "");
+        } else {
+            fprintf(file, "%s,%lu,%lu,%lu,%lu,%lu,%.3f,%.3f,%.3f,%.3f,%ld\n", result->engine, result->length, corpus->text_source_size, corpus->alphabet, corpus->density, result->matches, result->throughput, result->p50, result->p90, result->p99, result->peakRss);
+        }
+    }
+    if (json) {
+        fprintf(file, "]\n");
+    }
+}
+
+/**
+ Function compares results with baseline in CSV format of benchReport. Engine with pattern length, which is slower than baseline by more than tolerance percent, or which finds different number of matches in the same corpus, fails. Lines of baseline, which were not measured now, are skipped. Returns number of failures, -1 when baseline cannot be read.
+ */
+static int benchCompare(const char *baselineName, const benchCorpus *corpus, const benchResult *results, unsigned long numberOfResults, double tolerance) {
+    FILE *baseline = fopen(baselineName, "r");
+    char line[512];
+    int failures = 0;
     
+    if (!baseline) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), baseline)) {
+        char engine[64];
+        unsigned long length, size, alphabet, density, matches;
+        double throughput;
+        
+        if (sscanf(line, "%63[^,],%lu,%lu,%lu,%lu,%lu,%lf", engine, &length, &size, &alphabet, &density, &matches, &throughput) != 7) {
+            // header
+            continue;
+        }
+        for (unsigned long r = 0; r < numberOfResults; r++) {
+            if (strcmp(results[r].engine, engine) || results[r].length != length) {
+                continue;
+            }
+            int sameCorpus = size == corpus->text_source_size && alphabet == corpus->alphabet && density == corpus->density;
+            if (sameCorpus && results[r].matches != matches) {
+                fprintf(stderr, "%s with pattern of %lu bytes: %lu matches, baseline %lu\n", engine, length, results[r].matches, matches);
+                failures++;
+            } else if (results[r].throughput < throughput * (1 - tolerance / 100)) {
+                fprintf(stderr, "%s with pattern of %lu bytes: %.3f GB/s, baseline %.3f GB/s\n", engine, length, results[r].throughput, throughput);
+                failures++;
+            }
+        }
+    }
+    fclose(baseline);
+    return failures;
+}
+
+/**
+ Function parses list of numbers separated by commas. Returns number of them, 0 when list is wrong.
+ */
+static unsigned long benchParseLengths(const char *list, unsigned long *lengths) {
+    unsigned long count = 0;
+    const char *position = list;
     
+    while (*position) {
+        char *end;
+        unsigned long length = strtoul(position, &end, 10);
+        if (end == position || length == 0 || count >= BENCH_MAX_LENGTHS || (*end && *end != ',')) {
+            return 0;
+        }
+        lengths[count++] = length;
+        position = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ Benchmark generates synthetic corpus and measures every engine over patterns of every length in count mode, like the comparisons in README. It prints out throughput of median run, latency percentiles and peak resident memory as CSV or JSON. With baseline it fails, when some engine is slower than baseline or finds different number of matches, so it can guard against regressions. Engines must find the same number of matches, otherwise benchmark fails too.
+ argc, argv  - arguments after bench
+ */
+static int bench(int argc, char** argv) {
+    benchCorpus corpus;
+    unsigned long size = 256;           // MB of corpus
+    int json = 0;
+    int openCL = 0;
+    int cold = 0;
+    char *baselineName = NULL;
+    char *writeName = NULL;
+    double tolerance = 10;
+    static const char *engines[] = {"kmp", "bmh", "twoway", "ahocorasick", "shiftor", "threads", "opencl", "hybrid"};
+    static const char *ioEngines[IO_STRATEGIES] = {"io-mmap", "io-sequential", "io-huge", "io-populate", "io-read", "io-direct"};
+    char defaultFileName[4096];
     
-    size_t text_source_size;
-    int multithreading = 0;
-    int linesOption = 0;
-    int offsetOption = 0;
-    int fileLoaded = 0;
-    int patternLoaded = 0;
-    int debugOption = 0;
-    int i = 1;
+    memset(&corpus, 0, sizeof(benchCorpus));
+    corpus.alphabet = 26;
+    corpus.density = 16;
+    corpus.runs = 5;
+    corpus.numberOfLengths = benchParseLengths("2,4,8,16,32,64", corpus.lengths);
     
-    while (i < argc) {
-        if (!strcmp(argv[i], "-p")) {
-            strcpy(pattern, argv[i+1]);
-            i += 2;
-            patternLoaded = 1;
-            continue;
-        }else if (!strcmp(argv[i], "-f")) {
-            strcpy(textFileName, argv[i+1]);
-            i += 2;
-            fileLoaded = 1;
-            continue;
-        }else if (!strcmp(argv[i], "-h")) {
-            printf("aps [-tlod] [-p pattern] [-f file]\n\t-t\tmultithreading \n\t-l\touputs number of line and line itself\n\t-o\toutputs offset in bytes\n\t-d\touputs debug at the end\n\t-p\tpattern\n\t-f\tfile\n");
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-h")) {
+            printf("aps bench [-t] [-I] [-F file] [-j workers] [-S MB] [-A alphabet] [-D density] [-L lengths] [-r runs] [-J] [-w baseline] [-b baseline] [-x percent]\n\t-t\tmeasures also OpenCL device alone and together with native workers\n\t-I\tmeasures also every I/O strategy over corpus written into file, which is dropped from page cache before every run\n\t-F\tfile of -I (default aps-bench.tmp in $TMPDIR or /tmp), it is removed at the end\n\t-j\tnative workers of threads and hybrid engines, 0 means one worker per processor (default)\n\t-S\tsize of corpus in MB (default 256)\n\t-A\tnumber of different bytes of corpus (default 26, at most %lu)\n\t-D\toccurances of every pattern implanted in MB (default 16)\n\t-L\tlengths of patterns separated by commas (default 2,4,8,16,32,64)\n\t-r\tmeasured runs of every engine and pattern (default 5)\n\t-J\toutputs JSON instead of CSV\n\t-w\twrites results as CSV baseline\n\t-b\tcompares results with CSV baseline, fails when some engine is slower\n\t-x\tallowed slowdown against baseline in percent (default 10)\n", (unsigned long)sizeof(BENCH_ALPHABET) - 1);
             return EXIT_SUCCESS;
-        }else if (!strcmp(argv[i], "-t")) {
-            multithreading = 1;
-            i++;
-            continue;
-        }else if (!strcmp(argv[i], "-l")) {
-            linesOption = 1;
-            i++;
+        } else if (!strcmp(argv[i], "-t")) {
+            openCL = 1;
             continue;
-        }else if (!strcmp(argv[i], "-o")) {
-            offsetOption = 1;
-            i++;
+        } else if (!strcmp(argv[i], "-J")) {
+            json = 1;
             continue;
-        }else if (!strcmp(argv[i], "-d")){
-            debugOption = 1;
-            i++;
+        } else if (!strcmp(argv[i], "-I")) {
+            cold = 1;
             continue;
-        }else {
+        } else if (i + 1 >= argc) {
             printf("wrong argument %s\n", argv[i]);
-            printf("aps [-tlod] [-p pattern] [-f file]\nNAME\naps \nDESCRIPTION\nFile pattern searcher. Utility searches any given input files, selecting lines that match one patterns.\n");
+            return EXIT_FAILURE;
+        }
+        char *value = argv[++i];
+        if (!strcmp(argv[i - 1], "-j")) {
+            corpus.numOfWorkers = strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i - 1], "-S")) {
+            size = strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i - 1], "-A")) {
+            corpus.alphabet = strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i - 1], "-D")) {
+            corpus.density = strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i - 1], "-L")) {
+            corpus.numberOfLengths = benchParseLengths(value, corpus.lengths);
+        } else if (!strcmp(argv[i - 1], "-r")) {
+            corpus.runs = strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i - 1], "-w")) {
+            writeName = value;
+        } else if (!strcmp(argv[i - 1], "-b")) {
+            baselineName = value;
+        } else if (!strcmp(argv[i - 1], "-x")) {
+            tolerance = strtod(value, NULL);
+        } else if (!strcmp(argv[i - 1], "-F")) {
+            corpus.fileName = value;
+        } else {
+            printf("wrong argument %s\n", argv[i - 1]);
             return EXIT_FAILURE;
         }
     }
-    
-    if (!fileLoaded) {
-        printf("no file defined!\n");
-        return EXIT_FAILURE;
-    }
-    if (!patternLoaded) {
-        printf("no pattern defined!\n");
+    if (size == 0 || corpus.alphabet < 2 || corpus.alphabet > sizeof(BENCH_ALPHABET) - 1 || corpus.numberOfLengths == 0 || corpus.runs == 0 || corpus.runs > BENCH_MAX_RUNS) {
+        printf("wrong options of benchmark!\n");
         return EXIT_FAILURE;
     }
     
-    if ((fd = open(textFileName, O_RDONLY)) == -1) {
-        fprintf(stderr, "Error opening file\n");
-        exit(EXIT_FAILURE);
+    if (cold && !corpus.fileName) {
+        const char *directory = getenv("TMPDIR");
+        snprintf(defaultFileName, sizeof(defaultFileName), "%s/aps-bench.tmp", directory && *directory ? directory : "/tmp");
+        corpus.fileName = defaultFileName;
     }
-    
-    if (stat(textFileName, &sbuf) == -1) {
-        fprintf(stderr, "Stat error\n");
-        exit(EXIT_FAILURE);
+    if (!cold) {
+        corpus.fileName = NULL;
+    }
+    if (benchCorpusInit(&corpus, size * 1024 * 1024)) {
+        printf("Error: Failed to allocate memory for corpus!\n");
+        benchCorpusFree(&corpus);
+        return EXIT_FAILURE;
     }
-    printf("Proccessing ...\n");
-    
-
     
+    openCLRuntime runtime;
+    memset(&runtime, 0, sizeof(openCLRuntime));
+    if (openCL && openCLRuntimeInit(&runtime)) {
+        openCLRuntimeFree(&runtime);
+        benchCorpusFree(&corpus);
+        return EXIT_FAILURE;
+    }
     
-    /* Load text file */
-    textmemblock = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (textmemblock == (caddr_t)(-1)) {
-        fprintf(stderr, "Failed to load text file.\n");
+    unsigned long numberOfEngines = sizeof(engines) / sizeof(engines[0]) - (openCL ? 0 : 2);
+    unsigned long numberOfIoEngines = cold ? IO_STRATEGIES : 0;
+    benchResult *results = calloc((numberOfEngines + numberOfIoEngines) * corpus.numberOfLengths, sizeof(benchResult));
+    unsigned long numberOfResults = 0;
+    int failures = 0;
+    if (!results) {
+        printf("Error: Failed to allocate memory for results!\n");
         exit(1);
     }
-
-    text_source_size = sbuf.st_size;
-    
-    unsigned long resultSize = text_source_size;
-    
-    unsigned long *results = calloc(resultSize, sizeof(unsigned long));
-
-    unsigned long partSize;
-    
-    size_t numOfThreads = 1;
-    //Original
-    if (!multithreading) {
-        findStringSingleThread(textmemblock, text_source_size, pattern, results);
-        partSize = text_source_size;
-    } else {
-        // Connect to a compute device
-        //
-        err = clGetDeviceIDs(NULL, CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
-        if (err != CL_SUCCESS)
-        {
-            printf("Error: Failed to create a device group!\n");
-            return EXIT_FAILURE;
-        }
-        
-        
-        
-        
-        // Create a compute context
-        //
-        context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
-        if (!context)
-        {
-            printf("Error: Failed to create a compute context!\n");
+    for (unsigned long l = 0; l < corpus.numberOfLengths; l++) {
+        unsigned long first = numberOfResults;
+        benchCorpusFill(&corpus, l);
+        if (cold && benchCorpusWrite(&corpus)) {
+            fprintf(stderr, "Error writing corpus into %s\n", corpus.fileName);
+            unlink(corpus.fileName);
+            benchCorpusFree(&corpus);
+            free(results);
             return EXIT_FAILURE;
         }
-        
-        err = clGetDeviceInfo(device_id, CL_DEVICE_ADDRESS_BITS, sizeof(globalSize), &globalSize, NULL);
-        if (err != CL_SUCCESS)
-        {
-            printf("Error: Failed to retrieve device info! %d\n", err);
-            exit(1);
-        }
-        
-        size_t maxWorkGroupSize;
-        err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize, NULL);
-        if (err != CL_SUCCESS)
-        {
-            printf("Error: Failed to retrieve device info! %d\n", err);
-            exit(1);
-        }
-        
-        
-        cl_ulong maxMemAlloc;
-        err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxMemAlloc), &maxMemAlloc, NULL);
-        if (err != CL_SUCCESS)
-        {
-            printf("Error: Failed to retrieve device info! %d\n", err);
-            exit(1);
-        }
-        
-        //If device cannot hold big enough array program ends
-        //
-        if (maxMemAlloc < text_source_size) {
-            printf("Error: Too big file");
-            exit(EXIT_FAILURE);
-        }
-        
-        
-        // Create a command commands
-        //
-        commands = clCreateCommandQueue(context, device_id, 0, &err);
-        if (!commands)
-        {
-            printf("Error: Failed to create a command commands!\n");
-            exit(EXIT_FAILURE);
+        for (unsigned long e = 0; e < numberOfEngines + numberOfIoEngines; e++) {
+            const char *engine = e < numberOfEngines ? engines[e] : ioEngines[e - numberOfEngines];
+            int device = !strcmp(engine, "opencl") || !strcmp(engine, "hybrid");
+            if (benchEngine(&corpus, engine, l, device ? &runtime : NULL, &results[numberOfResults])) {
+                continue;
+            }
+            // every engine has to find the same matches as the first one
+            if (results[numberOfResults].matches != results[first].matches) {
+                fprintf(stderr, "%s with pattern of %lu bytes: %lu matches, %s %lu\n", engine, corpus.lengths[l], results[numberOfResults].matches, results[first].engine, results[first].matches);
+                failures++;
+            }
+            numberOfResults++;
         }
-        
-        // Create the compute program from the source buffer
-        //
-        
-        program = clCreateProgramWithSource(context, 1, (const char **) & source_str, NULL, &err);
-        if (!program)
-        {
-            printf("Error: Failed to create compute program!\n");
+    }
+    openCLRuntimeFree(&runtime);
+    if (cold) {
+        unlink(corpus.fileName);
+    }
+    
+    benchReport(stdout, &corpus, results, numberOfResults, json);
+    if (writeName) {
+        FILE *baseline = fopen(writeName, "w");
+        if (!baseline) {
+            fprintf(stderr, "Error opening baseline file\n");
+            benchCorpusFree(&corpus);
+            free(results);
             return EXIT_FAILURE;
         }
-        
-        // Build the program executable
-        //
-        err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-        if (err != CL_SUCCESS)
-        {
-            size_t len;
-            char buffer[2048];
-            
-            printf("Error: Failed to build program executable!\n");
-            clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-            printf("%s\n", buffer);
-            exit(1);
+        benchReport(baseline, &corpus, results, numberOfResults, 0);
+        fclose(baseline);
+    }
+    if (baselineName) {
+        int slower = benchCompare(baselineName, &corpus, results, numberOfResults, tolerance);
+        if (slower < 0) {
+            fprintf(stderr, "Error opening baseline file\n");
+            benchCorpusFree(&corpus);
+            free(results);
+            return EXIT_FAILURE;
         }
-        
-        
-        // Create the compute kernel in the program we wish to run
-        kernel = clCreateKernel(program, "run", &err);
-        if (!kernel || err != CL_SUCCESS)
-        {
-            printf("Error: Failed to create compute kernel!\n");
-            exit(1);
+        failures += slower;
+    }
+    benchCorpusFree(&corpus);
+    free(results);
+    return failures ? EXIT_FAILURE : 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "-s")) {
+        return serve();
+    }
+    if (argc >= 2 && !strcmp(argv[1], "index")) {
+        int status = 0;
+        if (argc == 2) {
+            printf("no file to index defined!\n");
+            return EXIT_FAILURE;
         }
-        
-        // Get the maximum work group size for executing the kernel on the device
-        //
-        err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
-       
-        if (err != CL_SUCCESS)
-        {
-            printf("Error: Failed to retrieve kernel work group info! %d\n", err);
-            exit(1);
+        for (int f = 2; f < argc; f++) {
+            status |= searchIndexBuild(argv[f]) != 0;
         }
-        
-        
-        numOfThreads = findStringMultiThread(device_id, context, commands, program, kernel, textmemblock, text_source_size, pattern, results, resultSize, &partSize);
-        
-        clReleaseProgram(program);
-        clReleaseKernel(kernel);
-        clReleaseCommandQueue(commands);
-        clReleaseContext(context);
+        return status ? EXIT_FAILURE : 0;
     }
-    
-
-    printResult(textmemblock, text_source_size, results, resultSize, partSize, linesOption, offsetOption);
-
-    if (debugOption) {
-        printf("\n-------------\n");
-        printf("Input size - %luB\n", text_source_size);
-        printf("Number of threads - %lu\n-------------\n", numOfThreads);
+    if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        return bench(argc - 2, argv + 2);
     }
-    
-    
-    // Shutdown and cleanup
-    //
-    
-    return 0;
+    return runSearch(argc, argv, NULL);
 }
+
+#endif
@@ -6,37 +6,135 @@
 //
 // Simple compute kernel which computes kmp of string given in input
 //
+// Matches are compacted in three passes: runCount counts matches of every
+// thread, scan turns counts into offsets and run writes matches of every
+// thread from its offset, so output is dense and sorted
+//
+// tiledCount and tiled are the same passes for work-groups, which load tiles
+// of text and pattern into local memory and check neighbouring positions
+//
+// Every byte of text goes through table fold, which folds case with -i,
+// pattern is folded already
+//
+// Count passes get stop with limit of matches (0 for none) and number of
+// matches found by all work items, with -m and -q they stop, when enough
+// matches are found
+//
 
 // KNUTH–MORRIS–PRATT
-__kernel void kmp(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned long *output, unsigned long counter)
+__kernel void kmp(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned char* fold, __global unsigned long *output, unsigned long index)
 {
     
     
     unsigned long i;
+    unsigned long counter = 0;
+    unsigned char c;
     int k = -1;
     if (!pi){
         return;
     }
-    unsigned long index = counter;
     
     
     for (i = 0; i < tsize; i++) {
-        while (k > -1 && pattern[k+1] != target[i])
+        if (k == -1) {
+            while (i + psize <= tsize && (fold[(unsigned char)target[i]] != (unsigned char)pattern[0] || fold[(unsigned char)target[i + psize - 1]] != (unsigned char)pattern[psize - 1]))
+                i++;
+            if (i + psize > tsize)
+                break;
+        }
+        c = fold[(unsigned char)target[i]];
+        while (k > -1 && (unsigned char)pattern[k+1] != c)
             k = pi[k];
-        if (target[i] == pattern[k+1])
+        if (c == (unsigned char)pattern[k+1])
             k++;
         if (k == psize - 1) {
             output[counter] = index + i - k;
             counter++;
-            k = -1;
+            k = pi[k];
             
         }
     }
-    output[counter] = -1;
     return;
 }
 
-__kernel void run(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize)
+__kernel void kmpCount(__global char *target, unsigned long tsize, __global char* pattern, __global int *pi, unsigned long psize, __global unsigned char* fold, __global unsigned long *output, unsigned long threadId, volatile __global unsigned int* stop)
+{
+    unsigned long i;
+    unsigned long counter = 0;
+    unsigned long check = 0;
+    unsigned int limit = stop[0];
+    unsigned char c;
+    int k = -1;
+    
+    for (i = 0; i < tsize; i++) {
+        /* matches of other work items are checked only once in a while, so limit costs nearly nothing */
+        if (limit && i >= check) {
+            if (stop[1] >= limit) {
+                break;
+            }
+            check = i + 4096;
+        }
+        if (k == -1) {
+            while (i + psize <= tsize && (fold[(unsigned char)target[i]] != (unsigned char)pattern[0] || fold[(unsigned char)target[i + psize - 1]] != (unsigned char)pattern[psize - 1]))
+                i++;
+            if (i + psize > tsize)
+                break;
+        }
+        c = fold[(unsigned char)target[i]];
+        while (k > -1 && (unsigned char)pattern[k+1] != c)
+            k = pi[k];
+        if (c == (unsigned char)pattern[k+1])
+            k++;
+        if (k == psize - 1) {
+            counter++;
+            k = pi[k];
+            if (limit) {
+                atomic_inc(&stop[1]);
+            }
+        }
+    }
+    output[threadId] = counter;
+}
+
+__kernel void scan(__global unsigned long* counts, unsigned long numberOfCounts)
+{
+    unsigned long i;
+    unsigned long sum = 0;
+    
+    /* there is count for every thread of run, so there are only few of them and one work item scans them */
+    if (get_global_id(0) != 0) {
+        return;
+    }
+    for (i = 0; i < numberOfCounts; i++) {
+        unsigned long count = counts[i];
+        counts[i] = sum;
+        sum += count;
+    }
+    counts[numberOfCounts] = sum;
+}
+
+__kernel void run(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize, __global unsigned char* fold, __global unsigned long* offsets)
+{
+    int threadId = get_global_id(0);
+    unsigned long partSize = inputSize / get_global_size(0);
+    if (partSize < psize) {
+        partSize = psize;
+    }
+
+    if (threadId * partSize >= inputSize) {
+        return;
+    }
+
+    unsigned long index = threadId * partSize;
+    unsigned long size = partSize + psize - 1;
+    
+    if (threadId == get_global_size(0) - 1 || index + size > inputSize) {
+        size = inputSize - index;
+    }
+    kmp(input + (index), size, pattern, pi, psize, fold, output + offsets[threadId], index);
+}
+
+__kernel void runCount(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi,  unsigned long psize, unsigned long inputSize, __global unsigned char* fold, volatile __global unsigned int* stop)
 {
     int threadId = get_global_id(0);
     unsigned long partSize = inputSize / get_global_size(0);
@@ -45,14 +143,147 @@ __kernel void run(__global char* input, __global unsigned long* output, __global
     }
 
     if (threadId * partSize >= inputSize) {
+        output[threadId] = 0;
         return;
     }
 
     unsigned long index = threadId * partSize;
+    unsigned long size = partSize + psize - 1;
+    
+    if (threadId == get_global_size(0) - 1 || index + size > inputSize) {
+        size = inputSize - index;
+    }
+    kmpCount(input + (index), size, pattern, pi, psize, fold, output, threadId, stop);
+}
+
+int tileMatch(__local char* text, __local char* pattern, unsigned long psize)
+{
+    unsigned long j;
+    
+    if (text[0] != pattern[0] || text[psize - 1] != pattern[psize - 1]) {
+        return 0;
+    }
+    for (j = 1; j + 1 < psize; j++) {
+        if (text[j] != pattern[j]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+__kernel void tiledCount(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi, unsigned long psize, unsigned long inputSize, __global unsigned char* fold, unsigned long tileSize, __local char* tile, __local char* localPattern, volatile __global unsigned int* stop)
+{
+    unsigned long localId = get_local_id(0);
+    unsigned long localSize = get_local_size(0);
+    unsigned long groups = get_num_groups(0);
+    unsigned long partSize = inputSize / groups;
+    unsigned long counter = 0;
+    unsigned long i, start, end, tileStart, positions;
+    unsigned int limit = stop[0];
+    
+    /* the whole group returns together, so nobody waits on barrier */
+    if (inputSize < psize) {
+        output[get_global_id(0)] = 0;
+        return;
+    }
+    if (partSize < psize) {
+        partSize = psize;
+    }
+    /* work-group checks positions from start to end, every match starts in part of one group */
+    start = get_group_id(0) * partSize;
+    end = start + partSize;
+    if (get_group_id(0) == groups - 1 || end > inputSize - psize + 1) {
+        end = inputSize - psize + 1;
+    }
+    
+    for (i = localId; i < psize; i += localSize) {
+        localPattern[i] = pattern[i];
+    }
+    for (tileStart = start; tileStart < end; tileStart += tileSize) {
+        positions = end - tileStart < tileSize ? end - tileStart : tileSize;
+        /* previous tile is not read anymore */
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (limit) {
+            /* the first work item decides for the whole group, so the group stops together */
+            if (localId == 0) {
+                tile[0] = stop[1] >= limit;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            if (tile[0]) {
+                break;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        /* text is folded, when it is loaded, so matching compares only bytes */
+        for (i = localId; i < positions + psize - 1; i += localSize) {
+            tile[i] = fold[(unsigned char)input[tileStart + i]];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (i = localId; i < positions; i += localSize) {
+            if (tileMatch(tile + i, localPattern, psize)) {
+                counter++;
+                if (limit) {
+                    atomic_inc(&stop[1]);
+                }
+            }
+        }
+    }
+    output[get_global_id(0)] = counter;
+}
+
+__kernel void tiled(__global char* input, __global unsigned long* output, __global char* pattern, __global int* pi, unsigned long psize, unsigned long inputSize, __global unsigned char* fold, __global unsigned long* offsets, unsigned long tileSize, __local char* tile, __local char* localPattern, __local unsigned int* ranks)
+{
+    unsigned long localId = get_local_id(0);
+    unsigned long localSize = get_local_size(0);
+    unsigned long groups = get_num_groups(0);
+    unsigned long partSize = inputSize / groups;
+    unsigned long written = 0;
+    unsigned long i, start, end, tileStart, positions, round, step;
+    unsigned int rank;
+    int found;
     
-    if (index + psize - 1 > inputSize) {
-        kmp(input + (index), partSize, pattern, pi, psize, output, index);
-    }else {
-        kmp(input + (index), partSize + psize - 1, pattern, pi, psize, output, index);
+    if (inputSize < psize) {
+        return;
+    }
+    if (partSize < psize) {
+        partSize = psize;
+    }
+    start = get_group_id(0) * partSize;
+    end = start + partSize;
+    if (get_group_id(0) == groups - 1 || end > inputSize - psize + 1) {
+        end = inputSize - psize + 1;
+    }
+    /* matches of group start at offset of its first work item */
+    output += offsets[get_group_id(0) * localSize];
+    
+    for (i = localId; i < psize; i += localSize) {
+        localPattern[i] = pattern[i];
+    }
+    for (tileStart = start; tileStart < end; tileStart += tileSize) {
+        positions = end - tileStart < tileSize ? end - tileStart : tileSize;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        /* text is folded, when it is loaded, so matching compares only bytes */
+        for (i = localId; i < positions + psize - 1; i += localSize) {
+            tile[i] = fold[(unsigned char)input[tileStart + i]];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        /* in every round work items check neighbouring positions, scan of found matches gives their order in output */
+        for (round = 0; round < positions; round += localSize) {
+            i = round + localId;
+            found = i < positions && tileMatch(tile + i, localPattern, psize);
+            ranks[localId] = found;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            for (step = 1; step < localSize; step *= 2) {
+                rank = localId >= step ? ranks[localId - step] : 0;
+                barrier(CLK_LOCAL_MEM_FENCE);
+                ranks[localId] += rank;
+                barrier(CLK_LOCAL_MEM_FENCE);
+            }
+            if (found) {
+                output[written + ranks[localId] - 1] = tileStart + i;
+            }
+            written += ranks[localSize - 1];
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
     }
 }